@@ -0,0 +1,234 @@
+/* Offscreen benchmark of laying out and drawing bars. The drawing code of
+ * sandbar is built in and run against plain pixman images, without a
+ * Wayland connection. */
+#define main sandbar_main
+#include "sandbar.c"
+#undef main
+
+#define BENCH_FRAMES 200
+
+/* Counts the allocations of sandbar's own code. The linker only wraps
+ * calls in the objects it links, so those inside the shared pixman and fcft
+ * libraries are not counted. */
+static uint64_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+/* The status is a format that takes the frame number, so that every frame
+ * has something to redraw */
+typedef struct {
+	const char *name;
+	uint32_t tags;
+	bool hide_vacant;
+	const char *title;
+	const char *status;
+} Scenario;
+
+static const Scenario scenarios[] = {
+	{ "9-tags", 9, false, "sandbar", "%u" },
+	{ "32-tags", 32, false, "sandbar", "%u" },
+	{ "hide-vacant", 32, true, "sandbar", "%u" },
+	{ "long-title", 9, false,
+	  "A window title long enough to be cut off where the status begins on every one of the tested widths "
+	  "A window title long enough to be cut off where the status begins on every one of the tested widths "
+	  "A window title long enough to be cut off where the status begins on every one of the tested widths "
+	  "A window title long enough to be cut off where the status begins on every one of the tested widths",
+	  "%u" },
+	{ "colored-status", 9, false, "sandbar",
+	  "^fg(ff5555)cpu^fg() ^bg(444444)%u%%^bg() ^fg(55ff55)mem^fg() ^bg(444444)1.2G^bg() "
+	  "^fg(5555ff)net^fg() ^bg(444444)^fg(ffff55)12k^fg()^bg() ^fg(ff55ff)vol^fg() ^bg(444444)50%%^bg() "
+	  "^fg(55ffff)bat^fg() ^bg(444444)^fg(ff5555)87%%^fg()^bg() ^fg(eeeeee)12:34^fg()" },
+	{ "emoji", 9, false, "\U0001f525 \U0001f680 sandbar \U0001f389",
+	  "\U0001f50b %u%% \U0001f4f6 \U0001f50a \U0001f4c5 \U0001f552" },
+};
+
+static const uint32_t widths[] = { 1920, 3840, 7680 };
+
+static void
+set_tags(uint32_t count)
+{
+	for (uint32_t i = 0; i < tags_l; i++)
+		free(tags[i]);
+	free(tags);
+
+	tags_l = count;
+	if (!(tags = malloc(tags_l * sizeof(char *))))
+		EDIE("malloc");
+	char buf[32];
+	for (uint32_t i = 0; i < tags_l; i++) {
+		snprintf(buf, sizeof(buf), "%d", i + 1);
+		if (!(tags[i] = strdup(buf)))
+			EDIE("strdup");
+	}
+}
+
+static void
+set_bench_status(Bar *bar, const Scenario *scenario, uint32_t frame)
+{
+	char buf[1024];
+	int len = snprintf(buf, sizeof(buf), scenario->status, frame);
+	set_status(bar, buf, MIN((size_t)len, sizeof(buf) - 1));
+}
+
+/* Lays out and draws one frame into the buffer the way draw_frame() does,
+ * minus the Wayland requests. With full set every segment is drawn, as if
+ * the buffer were new. Returns the number of glyphs drawn. */
+static uint64_t
+bench_frame(Bar *bar, Buffer *buffer, bool full)
+{
+	Surface *surface = &bar->surfaces[SURFACE_MAIN];
+	Layout *layout = &bar->text_layout;
+	update_surfaces(bar);
+
+	if (full)
+		buffer->segments_l = 0;
+	RenderJob *job = prepare_job(surface, buffer);
+
+	uint64_t glyphs = 0;
+	for (uint32_t i = 0; i < layout->parts_l; i++) {
+		Part *part = &layout->parts[i];
+		pixman_box32_t box = { .x1 = part->x1, .x2 = part->x2, .y1 = 0, .y2 = bar->height };
+		if (part->x1 < part->x2
+		    && pixman_region32_contains_rectangle(&job->clip, &box) != PIXMAN_REGION_OUT)
+			glyphs += part->glyphs_l;
+	}
+
+	render_job(job, &fill_cache, NULL);
+
+	/* The buffer is done with at once, as commit_frame() would leave it
+	 * once the compositor releases it */
+	pixman_region32_fini(&job->clip);
+	buffer->segments_l = job->segments_l;
+	buffer->busy = false;
+	surface->rendering = false;
+	return glyphs;
+}
+
+/* Loads the font for a scale in 120ths right away, unlike sandbar, which
+ * loads it in the background. Scales are kept cached between scenarios. */
+static struct fcft_font *
+bench_font(uint32_t scale)
+{
+	struct fcft_font *scaled = find_font(scale);
+	if (scaled)
+		return scaled;
+	if (!(scaled = load_font_at(scale)))
+		DIE("Could not load font at scale %g", scale / 120.0);
+	return cache_font(scale, scaled) ? find_font(scale) : scaled;
+}
+
+static void
+run_scenario(const Scenario *scenario, uint32_t width, uint32_t scale, uint32_t frames)
+{
+	set_tags(scenario->tags);
+	hide_vacant = scenario->hide_vacant;
+
+	Bar *bar = calloc(1, sizeof(Bar));
+	if (!bar)
+		EDIE("calloc");
+	wl_list_init(&bar->block_list);
+	use_font(bar, bench_font(scale * 120), scale * 120);
+	bar->surfaces_l = 1;
+	bar->surfaces[SURFACE_MAIN].bar = bar;
+	bar->surface_width = width / scale;
+	bar->width = width;
+	bar->height = bar->font->height + vertical_padding * 2 * scale;
+	bar->mtags = 1;
+	bar->ctags = 0x15;
+	bar->sel = true;
+	if (!(bar->layout = strdup("[]=")) || !(bar->title = strdup(scenario->title)))
+		EDIE("strdup");
+
+	Buffer buffer = {0};
+	if (!(buffer.image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, bar->height, NULL, width * 4)))
+		DIE("pixman_image_create_bits");
+
+	/* The first frame rasterizes the glyphs, which is left out */
+	set_bench_status(bar, scenario, 0);
+	bench_frame(bar, &buffer, true);
+
+	uint64_t times[2], allocs[2], glyphs = 0;
+	for (int full = 1; full >= 0; full--) {
+		uint64_t start_allocations = allocations, start = now_ns();
+		for (uint32_t frame = 1; frame <= frames; frame++) {
+			set_bench_status(bar, scenario, frame);
+			uint64_t drawn = bench_frame(bar, &buffer, full);
+			if (full)
+				glyphs += drawn;
+		}
+		times[full] = now_ns() - start;
+		allocs[full] = allocations - start_allocations;
+	}
+
+	printf("%-16s %5u %5u %12.0f %12.0f %14.0f %8.2f %8.2f\n",
+	       scenario->name, width, scale,
+	       (double)times[1] / frames, (double)times[0] / frames,
+	       glyphs * 1e9 / times[1],
+	       (double)allocs[1] / frames, (double)allocs[0] / frames);
+
+	pixman_image_unref(buffer.image);
+	free(buffer.segments);
+	free(bar->surfaces[SURFACE_MAIN].segments);
+	free(bar->status);
+	free(bar->layout);
+	free(bar->title);
+	free(bar->text_layout.parts);
+	free(bar->text_layout.glyphs);
+	free_measures(bar);
+	put_font(bar->font);
+	free(bar);
+}
+
+/* Usage: bench [FRAMES] [SCENARIO] */
+int
+main(int argc, char **argv)
+{
+	uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_FRAMES;
+	if (!frames)
+		DIE("bench: invalid number of frames");
+
+	wl_list_init(&module_list);
+	wl_list_init(&seat_list);
+	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
+	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
+
+	/* "full" redraws every part, "tick" only what the status change
+	 * touched */
+	printf("%-16s %5s %5s %12s %12s %14s %8s %8s\n", "scenario", "width", "scale",
+	       "full ns/frm", "tick ns/frm", "full glyphs/s", "full a/f", "tick a/f");
+	for (size_t i = 0; i < LENGTH(scenarios); i++) {
+		if (argc > 2 && strcmp(argv[2], scenarios[i].name))
+			continue;
+		for (size_t j = 0; j < LENGTH(widths); j++)
+			for (uint32_t scale = 1; scale <= 3; scale++)
+				run_scenario(&scenarios[i], widths[j], scale, frames);
+	}
+
+	font_cache_finish();
+	fill_cache_finish(&fill_cache);
+	fcft_fini();
+	return 0;
+}
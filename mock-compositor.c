@@ -0,0 +1,1093 @@
+/* Headless stand-in for river, for testing sandbar end to end without a
+ * session. It implements just enough of wl_compositor, wl_shm, wl_output,
+ * wl_seat, the layer shell and river's status and control protocols, runs
+ * sandbar on its socket and times the frames it commits.
+ *
+ * Once every output shows a bar, status lines are written to sandbar's
+ * stdin one at a time and the time until every bar committed it is
+ * measured. Then tag, title and status storms, and output hotplug if asked
+ * for, run for a while and the commits per second are counted. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include "wlr-layer-shell-unstable-v1-server-protocol.h"
+#include "river-status-unstable-v1-server-protocol.h"
+#include "river-control-unstable-v1-server-protocol.h"
+
+#define DIE(fmt, ...)						\
+	do {							\
+		fprintf(stderr, fmt "\n", ##__VA_ARGS__);	\
+		exit(1);					\
+	} while (0)
+#define EDIE(s)							\
+	do {							\
+		fprintf(stderr, "%s: %s\n", s, strerror(errno));	\
+		exit(1);					\
+	} while (0)
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define USAGE								\
+	"usage: mock-compositor [OPTIONS] [-- COMMAND [ARGS]...]\n"	\
+	"	-outputs [NUMBER]		specify how many outputs there are at first\n" \
+	"	-size [WIDTH]x[HEIGHT]		specify the mode of the outputs\n" \
+	"	-refresh [HZ]			specify the refresh rate of the outputs\n" \
+	"	-release-delay [MS]		hold committed buffers for this long\n" \
+	"	-samples [NUMBER]		specify how many status lines are timed\n" \
+	"	-storm [RATE]			send this many tag, title and status updates per second under load, up to 1000\n" \
+	"	-hotplug [MS]			remove and add back the last output this often under load\n" \
+	"	-duration [SECONDS]		specify how long to run under load\n" \
+	"The command defaults to sandbar -no-socket.\n"
+
+#define MAX_SAMPLES 100000
+/* Width of the right end of a bar compared between commits, which the
+ * probe's status text falls in */
+#define STATUS_REGION_WIDTH 256
+
+typedef struct {
+	uint32_t index;
+	struct wl_global *global;
+	struct wl_list resources, status_resources;
+	/* Set once the output's bar committed the probe being timed */
+	bool mapped, probed;
+	struct wl_list link;
+} Output;
+
+/* Buffer reference that is cleared when the client destroys the buffer */
+typedef struct {
+	struct wl_resource *resource;
+	struct wl_listener destroy;
+} BufferRef;
+
+typedef struct {
+	BufferRef ref;
+	uint64_t due;
+	struct wl_list link;
+} Release;
+
+typedef struct {
+	struct wl_resource *resource;
+	struct wl_resource *layer_surface;
+	Output *output;
+	BufferRef pending;
+	bool attached, mapped, configuring;
+	uint32_t width, height;
+	/* Right edge of the buffer damage since the last commit */
+	int32_t damage_x2;
+	/* Pixels of the status region as last committed */
+	uint32_t *status_pixels;
+	size_t status_pixels_l;
+	struct wl_list pending_frames;
+	struct wl_list link;
+} Surface;
+
+static struct wl_display *display;
+static struct wl_event_loop *loop;
+static struct wl_list output_list, surface_list, release_list, frame_list;
+static struct wl_list seat_resources, seat_status_resources;
+static uint32_t outputs_l = 1, output_width = 1920, output_height = 1080, refresh = 60;
+static uint32_t release_delay, storm_rate = 1000, hotplug_interval, duration = 5;
+static uint32_t samples_l = 200;
+
+static struct wl_event_source *frame_timer, *release_timer, *probe_timer, *storm_timer, *hotplug_timer,
+	*end_timer;
+
+static pid_t child = -1;
+static int child_stdin = -1;
+static bool running = true;
+static uint64_t start_time, mapped_time, load_time;
+static uint64_t probe_time, *samples;
+static uint32_t samples_done;
+static uint64_t commits, status_lines, dropped_lines, storm_ticks, commands;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+unlink_resource(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void
+destroy_resource(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+buffer_ref_destroyed(struct wl_listener *listener, void *data)
+{
+	BufferRef *ref = wl_container_of(listener, ref, destroy);
+	ref->resource = NULL;
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+}
+
+static void
+buffer_ref_set(BufferRef *ref, struct wl_resource *resource)
+{
+	wl_list_remove(&ref->destroy.link);
+	wl_list_init(&ref->destroy.link);
+	ref->resource = resource;
+	ref->destroy.notify = buffer_ref_destroyed;
+	if (resource)
+		wl_resource_add_destroy_listener(resource, &ref->destroy);
+}
+
+/* Writes a line to the child's stdin. Lines that do not fit in the pipe
+ * are dropped rather than blocking the compositor; returns whether it was
+ * written. */
+static bool
+send_line(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (write(child_stdin, buf, MIN((size_t)len, sizeof(buf) - 1)) == -1) {
+		if (errno != EAGAIN)
+			EDIE("write");
+		dropped_lines++;
+		return false;
+	}
+	status_lines++;
+	return true;
+}
+
+/* Buffers are held for the release delay after being committed, as if the
+ * compositor were still reading them */
+static void
+arm_release_timer(void)
+{
+	uint64_t due = UINT64_MAX, now = now_ns();
+	Release *release;
+	wl_list_for_each(release, &release_list, link)
+		due = MIN(due, release->due);
+	if (due == UINT64_MAX)
+		wl_event_source_timer_update(release_timer, 0);
+	else
+		wl_event_source_timer_update(release_timer, MAX((int64_t)(due - now) / 1000000, 1));
+}
+
+static int
+release_timer_handler(void *data)
+{
+	uint64_t now = now_ns();
+	Release *release, *tmp;
+	wl_list_for_each_safe(release, tmp, &release_list, link) {
+		if (release->due > now)
+			continue;
+		if (release->ref.resource)
+			wl_buffer_send_release(release->ref.resource);
+		wl_list_remove(&release->ref.destroy.link);
+		wl_list_remove(&release->link);
+		free(release);
+	}
+	arm_release_timer();
+	return 0;
+}
+
+static void
+release_buffer(struct wl_resource *resource)
+{
+	if (!release_delay) {
+		wl_buffer_send_release(resource);
+		return;
+	}
+	Release *release = calloc(1, sizeof(Release));
+	if (!release)
+		EDIE("calloc");
+	wl_list_init(&release->ref.destroy.link);
+	buffer_ref_set(&release->ref, resource);
+	release->due = now_ns() + (uint64_t)release_delay * 1000000;
+	wl_list_insert(release_list.prev, &release->link);
+	arm_release_timer();
+}
+
+static int
+frame_timer_handler(void *data)
+{
+	uint32_t ms = now_ns() / 1000000;
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &frame_list) {
+		wl_callback_send_done(callback, ms);
+		wl_resource_destroy(callback);
+	}
+	wl_event_source_timer_update(frame_timer, MAX(1000 / refresh, 1));
+	return 0;
+}
+
+static void
+start_load(void)
+{
+	commits = 0;
+	status_lines = dropped_lines = 0;
+	load_time = now_ns();
+	if (storm_rate)
+		wl_event_source_timer_update(storm_timer, MAX(1000 / storm_rate, 1));
+	if (hotplug_interval)
+		wl_event_source_timer_update(hotplug_timer, hotplug_interval);
+	wl_event_source_timer_update(end_timer, duration * 1000);
+}
+
+/* Writes the next timed status line once the previous one was committed */
+static int
+probe_timer_handler(void *data)
+{
+	if (samples_done == samples_l) {
+		start_load();
+		return 0;
+	}
+	if (!send_line("all status probe %u\n", samples_done)) {
+		wl_event_source_timer_update(probe_timer, 20);
+		return 0;
+	}
+	probe_time = now_ns();
+	return 0;
+}
+
+/* Copies the status region of a committed buffer and returns whether it
+ * differs from that of the previous commit. Only ARGB8888 and XRGB8888 are
+ * advertised, so pixels are 32 bits. */
+static bool
+status_region_changed(Surface *surface, struct wl_shm_buffer *buffer)
+{
+	int32_t width = wl_shm_buffer_get_width(buffer), height = wl_shm_buffer_get_height(buffer);
+	int32_t stride = wl_shm_buffer_get_stride(buffer);
+	int32_t x = MAX(width - STATUS_REGION_WIDTH, 0), region_width = width - x;
+	bool changed = false;
+
+	if ((size_t)region_width * height != surface->status_pixels_l) {
+		surface->status_pixels_l = (size_t)region_width * height;
+		if (!(surface->status_pixels = realloc(surface->status_pixels,
+						       MAX(surface->status_pixels_l, 1) * sizeof(uint32_t))))
+			EDIE("realloc");
+		changed = true;
+	}
+
+	wl_shm_buffer_begin_access(buffer);
+	const char *data = wl_shm_buffer_get_data(buffer);
+	for (int32_t y = 0; y < height; y++) {
+		const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride) + x;
+		uint32_t *copy = surface->status_pixels + (size_t)y * region_width;
+		if (changed || memcmp(row, copy, region_width * sizeof(uint32_t))) {
+			memcpy(copy, row, region_width * sizeof(uint32_t));
+			changed = true;
+		}
+	}
+	wl_shm_buffer_end_access(buffer);
+	return changed;
+}
+
+/* A buffer committed after a probe line was sent carries it if its damage
+ * reaches the right edge, where the status is, and the status region
+ * actually looks different from the previous commit. Storms only start once
+ * sampling is over, so nothing else changes the status meanwhile. The
+ * sample ends once every
+ * mapped output committed one, so that other commits, e.g. of another
+ * output or a retried frame, do not end it early. */
+static void
+surface_committed(Surface *surface, bool status_damaged)
+{
+	commits++;
+
+	if (!surface->output->mapped) {
+		surface->output->mapped = true;
+		Output *output;
+		wl_list_for_each(output, &output_list, link)
+			if (output->global && !output->mapped)
+				return;
+		if (!mapped_time) {
+			/* Let startup settle before timing anything */
+			mapped_time = now_ns();
+			wl_event_source_timer_update(probe_timer, 200);
+		}
+	}
+
+	if (!probe_time || !status_damaged)
+		return;
+	surface->output->probed = true;
+	Output *output;
+	wl_list_for_each(output, &output_list, link)
+		if (output->global && output->mapped && !output->probed)
+			return;
+	wl_list_for_each(output, &output_list, link)
+		output->probed = false;
+	samples[samples_done++] = now_ns() - probe_time;
+	probe_time = 0;
+	wl_event_source_timer_update(probe_timer, 20);
+}
+
+static void
+surface_attach(struct wl_client *client, struct wl_resource *resource,
+	       struct wl_resource *buffer, int32_t x, int32_t y)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	if (buffer && !wl_shm_buffer_get(buffer)) {
+		wl_client_post_implementation_error(client, "only wl_shm buffers are supported");
+		return;
+	}
+	buffer_ref_set(&surface->pending, buffer);
+	surface->attached = true;
+}
+
+static void
+surface_damage(struct wl_client *client, struct wl_resource *resource,
+	       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static void
+surface_damage_buffer(struct wl_client *client, struct wl_resource *resource,
+		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	surface->damage_x2 = MAX(surface->damage_x2, x + width);
+}
+
+static void
+surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback = wl_resource_create(client, &wl_callback_interface, 1, id);
+	if (!callback) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(callback, NULL, NULL, unlink_resource);
+	wl_list_insert(surface->pending_frames.prev, wl_resource_get_link(callback));
+}
+
+static void
+surface_set_region(struct wl_client *client, struct wl_resource *resource, struct wl_resource *region)
+{
+}
+
+/* Layer surfaces are configured to the size of their output whenever they
+ * commit without a buffer, which is how they are mapped and mapped again */
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+
+	wl_list_insert_list(frame_list.prev, &surface->pending_frames);
+	wl_list_init(&surface->pending_frames);
+
+	if (surface->attached) {
+		surface->attached = false;
+		surface->mapped = surface->pending.resource;
+		if (surface->pending.resource) {
+			struct wl_shm_buffer *buffer = wl_shm_buffer_get(surface->pending.resource);
+			bool status_damaged = surface->damage_x2 >= wl_shm_buffer_get_width(buffer)
+				&& status_region_changed(surface, buffer);
+			release_buffer(surface->pending.resource);
+			buffer_ref_set(&surface->pending, NULL);
+			if (surface->output)
+				surface_committed(surface, status_damaged);
+		}
+	}
+	surface->damage_x2 = 0;
+
+	if (surface->layer_surface && !surface->mapped && !surface->configuring && surface->output) {
+		zwlr_layer_surface_v1_send_configure(surface->layer_surface, wl_display_next_serial(display),
+						     surface->width ? surface->width : output_width,
+						     surface->height ? surface->height : output_height);
+		surface->configuring = true;
+	}
+}
+
+static void
+surface_set_buffer_transform(struct wl_client *client, struct wl_resource *resource, int32_t transform)
+{
+}
+
+static void
+surface_set_buffer_scale(struct wl_client *client, struct wl_resource *resource, int32_t scale)
+{
+}
+
+static void
+surface_offset(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y)
+{
+}
+
+static const struct wl_surface_interface surface_impl = {
+	.destroy = destroy_resource,
+	.attach = surface_attach,
+	.damage = surface_damage,
+	.frame = surface_frame,
+	.set_opaque_region = surface_set_region,
+	.set_input_region = surface_set_region,
+	.commit = surface_commit,
+	.set_buffer_transform = surface_set_buffer_transform,
+	.set_buffer_scale = surface_set_buffer_scale,
+	.damage_buffer = surface_damage_buffer,
+	.offset = surface_offset,
+};
+
+static void
+surface_destroy(struct wl_resource *resource)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &surface->pending_frames)
+		wl_resource_destroy(callback);
+	wl_list_remove(&surface->pending.destroy.link);
+	if (surface->layer_surface)
+		wl_resource_set_user_data(surface->layer_surface, NULL);
+	wl_list_remove(&surface->link);
+	free(surface->status_pixels);
+	free(surface);
+}
+
+static void
+region_rect(struct wl_client *client, struct wl_resource *resource,
+	    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+}
+
+static const struct wl_region_interface region_impl = {
+	.destroy = destroy_resource,
+	.add = region_rect,
+	.subtract = region_rect,
+};
+
+static void
+compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	Surface *surface = calloc(1, sizeof(Surface));
+	if (!surface || !(surface->resource = wl_resource_create(client, &wl_surface_interface,
+								 wl_resource_get_version(resource), id))) {
+		free(surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_list_init(&surface->pending.destroy.link);
+	wl_list_init(&surface->pending_frames);
+	wl_resource_set_implementation(surface->resource, &surface_impl, surface, surface_destroy);
+	wl_list_insert(&surface_list, &surface->link);
+}
+
+static void
+compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+	if (!region) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+	.create_surface = compositor_create_surface,
+	.create_region = compositor_create_region,
+};
+
+static void
+bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &compositor_impl, NULL, NULL);
+}
+
+static void
+output_release(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+	.release = output_release,
+};
+
+static void
+bind_output(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	Output *output = data;
+	struct wl_resource *resource = wl_resource_create(client, &wl_output_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, output, unlink_resource);
+	wl_list_insert(&output->resources, wl_resource_get_link(resource));
+
+	char name[32];
+	snprintf(name, sizeof(name), "MOCK-%u", output->index + 1);
+	wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+				"mock", "mock", WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+			    output_width, output_height, refresh * 1000);
+	if (version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+		wl_output_send_scale(resource, 1);
+	if (version >= WL_OUTPUT_NAME_SINCE_VERSION)
+		wl_output_send_name(resource, name);
+	if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+		wl_output_send_done(resource);
+}
+
+static void
+add_output(Output *output)
+{
+	output->global = wl_global_create(display, &wl_output_interface, 4, output, bind_output);
+	if (!output->global)
+		DIE("Could not create wl_output global");
+}
+
+/* Outputs keep their resources after their global is gone, like on a real
+ * compositor, and come back under a new global */
+static void
+remove_output(Output *output)
+{
+	wl_global_destroy(output->global);
+	output->global = NULL;
+	output->mapped = false;
+
+	Surface *surface;
+	wl_list_for_each(surface, &surface_list, link)
+		if (surface->output == output)
+			surface->output = NULL;
+}
+
+/* No capabilities are announced, so input devices never send anything */
+static void
+create_device(struct wl_client *client, struct wl_resource *seat, const struct wl_interface *interface,
+	      uint32_t id)
+{
+	struct wl_resource *device = wl_resource_create(client, interface, wl_resource_get_version(seat), id);
+	if (!device) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(device, NULL, NULL, NULL);
+}
+
+static void
+seat_get_pointer(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	create_device(client, resource, &wl_pointer_interface, id);
+}
+
+static void
+seat_get_keyboard(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	create_device(client, resource, &wl_keyboard_interface, id);
+}
+
+static void
+seat_get_touch(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+	create_device(client, resource, &wl_touch_interface, id);
+}
+
+static const struct wl_seat_interface seat_impl = {
+	.get_pointer = seat_get_pointer,
+	.get_keyboard = seat_get_keyboard,
+	.get_touch = seat_get_touch,
+	.release = destroy_resource,
+};
+
+static void
+bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &seat_impl, NULL, unlink_resource);
+	wl_list_insert(&seat_resources, wl_resource_get_link(resource));
+	wl_seat_send_capabilities(resource, 0);
+	if (version >= WL_SEAT_NAME_SINCE_VERSION)
+		wl_seat_send_name(resource, "seat0");
+}
+
+static void
+layer_surface_set_size(struct wl_client *client, struct wl_resource *resource,
+		       uint32_t width, uint32_t height)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->width = width;
+		surface->height = height;
+	}
+}
+
+static void
+layer_surface_set_uint(struct wl_client *client, struct wl_resource *resource, uint32_t value)
+{
+}
+
+static void
+layer_surface_set_exclusive_zone(struct wl_client *client, struct wl_resource *resource, int32_t zone)
+{
+}
+
+static void
+layer_surface_set_margin(struct wl_client *client, struct wl_resource *resource,
+			 int32_t top, int32_t right, int32_t bottom, int32_t left)
+{
+}
+
+static void
+layer_surface_get_popup(struct wl_client *client, struct wl_resource *resource, struct wl_resource *popup)
+{
+}
+
+static void
+layer_surface_ack_configure(struct wl_client *client, struct wl_resource *resource, uint32_t serial)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	if (surface)
+		surface->configuring = false;
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+	.set_size = layer_surface_set_size,
+	.set_anchor = layer_surface_set_uint,
+	.set_exclusive_zone = layer_surface_set_exclusive_zone,
+	.set_margin = layer_surface_set_margin,
+	.set_keyboard_interactivity = layer_surface_set_uint,
+	.get_popup = layer_surface_get_popup,
+	.ack_configure = layer_surface_ack_configure,
+	.destroy = destroy_resource,
+	.set_layer = layer_surface_set_uint,
+};
+
+static void
+layer_surface_destroy(struct wl_resource *resource)
+{
+	Surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->layer_surface = NULL;
+		surface->output = NULL;
+	}
+}
+
+static void
+layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			      struct wl_resource *surface_resource, struct wl_resource *output_resource,
+			      uint32_t layer, const char *namespace)
+{
+	Surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *layer_surface = wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+							      wl_resource_get_version(resource), id);
+	if (!layer_surface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(layer_surface, &layer_surface_impl, surface, layer_surface_destroy);
+	surface->layer_surface = layer_surface;
+	if (output_resource)
+		surface->output = wl_resource_get_user_data(output_resource);
+	else if (!wl_list_empty(&output_list))
+		surface->output = wl_container_of(output_list.next, surface->output, link);
+	if (surface->output && !surface->output->global)
+		surface->output = NULL;
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+	.get_layer_surface = layer_shell_get_layer_surface,
+	.destroy = destroy_resource,
+};
+
+static void
+bind_layer_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &layer_shell_impl, NULL, NULL);
+}
+
+static void
+send_output_status(struct wl_resource *resource, uint32_t n)
+{
+	struct wl_array view_tags;
+	wl_array_init(&view_tags);
+	for (uint32_t i = 0; i < 3; i++) {
+		uint32_t *tags = wl_array_add(&view_tags, sizeof(uint32_t));
+		if (tags)
+			*tags = 1 << ((n + i * 2) % 9);
+	}
+	zriver_output_status_v1_send_focused_tags(resource, 1 << (n % 9));
+	zriver_output_status_v1_send_view_tags(resource, &view_tags);
+	if (wl_resource_get_version(resource) >= ZRIVER_OUTPUT_STATUS_V1_URGENT_TAGS_SINCE_VERSION)
+		zriver_output_status_v1_send_urgent_tags(resource, n % 5 ? 0 : 1 << 8);
+	wl_array_release(&view_tags);
+}
+
+static const struct zriver_output_status_v1_interface output_status_impl = {
+	.destroy = destroy_resource,
+};
+
+static const struct zriver_seat_status_v1_interface seat_status_impl = {
+	.destroy = destroy_resource,
+};
+
+static void
+status_manager_get_output_status(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+				 struct wl_resource *output_resource)
+{
+	Output *output = wl_resource_get_user_data(output_resource);
+	struct wl_resource *status = wl_resource_create(client, &zriver_output_status_v1_interface,
+						       wl_resource_get_version(resource), id);
+	if (!status) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(status, &output_status_impl, output, unlink_resource);
+	wl_list_insert(&output->status_resources, wl_resource_get_link(status));
+	send_output_status(status, 0);
+	if (wl_resource_get_version(status) >= ZRIVER_OUTPUT_STATUS_V1_LAYOUT_NAME_SINCE_VERSION)
+		zriver_output_status_v1_send_layout_name(status, "[]=");
+}
+
+static void
+status_manager_get_seat_status(struct wl_client *client, struct wl_resource *resource, uint32_t id,
+			       struct wl_resource *seat)
+{
+	struct wl_resource *status = wl_resource_create(client, &zriver_seat_status_v1_interface,
+						       MIN(wl_resource_get_version(resource), 3), id);
+	if (!status) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(status, &seat_status_impl, NULL, unlink_resource);
+	wl_list_insert(&seat_status_resources, wl_resource_get_link(status));
+
+	if (!wl_list_empty(&output_list)) {
+		Output *output = wl_container_of(output_list.next, output, link);
+		struct wl_resource *output_resource = wl_resource_find_for_client(&output->resources, client);
+		if (output_resource)
+			zriver_seat_status_v1_send_focused_output(status, output_resource);
+	}
+	zriver_seat_status_v1_send_focused_view(status, "mock");
+	if (wl_resource_get_version(status) >= ZRIVER_SEAT_STATUS_V1_MODE_SINCE_VERSION)
+		zriver_seat_status_v1_send_mode(status, "normal");
+}
+
+static const struct zriver_status_manager_v1_interface status_manager_impl = {
+	.destroy = destroy_resource,
+	.get_river_output_status = status_manager_get_output_status,
+	.get_river_seat_status = status_manager_get_seat_status,
+};
+
+static void
+bind_status_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &zriver_status_manager_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &status_manager_impl, NULL, NULL);
+}
+
+static void
+control_add_argument(struct wl_client *client, struct wl_resource *resource, const char *argument)
+{
+}
+
+/* Every command succeeds without doing anything */
+static void
+control_run_command(struct wl_client *client, struct wl_resource *resource,
+		    struct wl_resource *seat, uint32_t id)
+{
+	struct wl_resource *callback = wl_resource_create(client, &zriver_command_callback_v1_interface, 1, id);
+	if (!callback) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(callback, NULL, NULL, NULL);
+	zriver_command_callback_v1_send_success(callback, "");
+	wl_resource_destroy(callback);
+	commands++;
+}
+
+static const struct zriver_control_v1_interface control_impl = {
+	.destroy = destroy_resource,
+	.add_argument = control_add_argument,
+	.run_command = control_run_command,
+};
+
+static void
+bind_control(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &zriver_control_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &control_impl, NULL, NULL);
+}
+
+/* Tags of every output, the focused title and the status change on each
+ * tick */
+static int
+storm_timer_handler(void *data)
+{
+	uint32_t n = ++storm_ticks;
+	Output *output;
+	wl_list_for_each(output, &output_list, link) {
+		struct wl_resource *resource;
+		wl_resource_for_each(resource, &output->status_resources)
+			send_output_status(resource, n);
+	}
+
+	char title[64];
+	snprintf(title, sizeof(title), "mock window %u", n);
+	struct wl_resource *resource;
+	wl_resource_for_each(resource, &seat_status_resources)
+		zriver_seat_status_v1_send_focused_view(resource, title);
+
+	send_line("all status load %u\n", n);
+
+	wl_event_source_timer_update(storm_timer, MAX(1000 / storm_rate, 1));
+	return 0;
+}
+
+static int
+hotplug_timer_handler(void *data)
+{
+	Output *output = wl_container_of(output_list.prev, output, link);
+	if (output->global)
+		remove_output(output);
+	else
+		add_output(output);
+	wl_event_source_timer_update(hotplug_timer, hotplug_interval);
+	return 0;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(void)
+{
+	double load_seconds = (now_ns() - load_time) / 1e9;
+
+	printf("startup to all bars mapped: %.3f ms\n", (mapped_time - start_time) / 1e6);
+	if (samples_done) {
+		qsort(samples, samples_done, sizeof(uint64_t), compare_u64);
+		printf("status to commit latency over %u lines: min %.3f ms, median %.3f ms, "
+		       "p99 %.3f ms, max %.3f ms\n", samples_done,
+		       samples[0] / 1e6, samples[samples_done / 2] / 1e6,
+		       samples[samples_done * 99 / 100] / 1e6, samples[samples_done - 1] / 1e6);
+	}
+	printf("under load for %.1f s: %.1f commits/s, %.1f status lines/s (%lu dropped), "
+	       "%lu storm ticks, %lu river commands\n", load_seconds,
+	       commits / load_seconds, status_lines / load_seconds, (unsigned long)dropped_lines,
+	       (unsigned long)storm_ticks, (unsigned long)commands);
+}
+
+static int
+end_timer_handler(void *data)
+{
+	report();
+	running = false;
+	return 0;
+}
+
+static int
+handle_sigchld(int signal_number, void *data)
+{
+	int status;
+	if (waitpid(child, &status, WNOHANG) != child)
+		return 0;
+	child = -1;
+	if (running) {
+		fprintf(stderr, "Child exited before the test ended\n");
+		exit(1);
+	}
+	return 0;
+}
+
+static void
+spawn(char **argv, const char *socket)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		EDIE("pipe2");
+
+	if ((child = fork()) == -1)
+		EDIE("fork");
+	if (child == 0) {
+		/* The event loop blocks the signals it watches, and the child
+		 * should not inherit that */
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		if (dup2(fds[0], STDIN_FILENO) == -1)
+			EDIE("dup2");
+		setenv("WAYLAND_DISPLAY", socket, 1);
+		execvp(argv[0], argv);
+		EDIE("execvp");
+	}
+
+	close(fds[0]);
+	child_stdin = fds[1];
+	if (fcntl(child_stdin, F_SETFL, O_NONBLOCK) == -1)
+		EDIE("fcntl");
+}
+
+static uint32_t
+parse_number(int argc, char **argv, int i)
+{
+	if (i >= argc)
+		DIE("Option %s requires an argument", argv[i - 1]);
+	char *end;
+	unsigned long value = strtoul(argv[i], &end, 10);
+	if (*end || value > UINT32_MAX)
+		DIE("%s: invalid argument", argv[i - 1]);
+	return value;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *default_command[] = { "sandbar", "-no-socket", NULL };
+	char **command = default_command;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			if (i + 1 < argc)
+				command = &argv[i + 1];
+			break;
+		} else if (!strcmp(argv[i], "-outputs")) {
+			outputs_l = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-size")) {
+			if (++i >= argc || sscanf(argv[i], "%ux%u", &output_width, &output_height) != 2)
+				DIE("-size: invalid argument");
+		} else if (!strcmp(argv[i], "-refresh")) {
+			refresh = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-release-delay")) {
+			release_delay = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-samples")) {
+			samples_l = MIN(parse_number(argc, argv, ++i), MAX_SAMPLES);
+		} else if (!strcmp(argv[i], "-storm")) {
+			storm_rate = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-hotplug")) {
+			hotplug_interval = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-duration")) {
+			duration = parse_number(argc, argv, ++i);
+		} else if (!strcmp(argv[i], "-h")) {
+			fprintf(stderr, USAGE);
+			return 0;
+		} else {
+			DIE("Option '%s' not recognized\n" USAGE, argv[i]);
+		}
+	}
+	if (!outputs_l || !refresh || !duration)
+		DIE("-outputs, -refresh and -duration must not be 0");
+
+	/* Headless boxes may have no session, and so no runtime directory */
+	char runtime_dir[] = "/tmp/mock-compositor-XXXXXX";
+	bool own_runtime_dir = !getenv("XDG_RUNTIME_DIR");
+	if (own_runtime_dir) {
+		if (!mkdtemp(runtime_dir))
+			EDIE("mkdtemp");
+		setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+	}
+	if (!(samples = calloc(MAX(samples_l, 1), sizeof(uint64_t))))
+		EDIE("calloc");
+	wl_list_init(&output_list);
+	wl_list_init(&surface_list);
+	wl_list_init(&release_list);
+	wl_list_init(&frame_list);
+	wl_list_init(&seat_resources);
+	wl_list_init(&seat_status_resources);
+
+	if (!(display = wl_display_create()))
+		DIE("Could not create display");
+	const char *socket = wl_display_add_socket_auto(display);
+	if (!socket)
+		DIE("Could not add socket");
+	if (wl_display_init_shm(display) == -1)
+		DIE("Could not initialize wl_shm");
+
+	if (!wl_global_create(display, &wl_compositor_interface, 4, NULL, bind_compositor)
+	    || !wl_global_create(display, &wl_seat_interface, 7, NULL, bind_seat)
+	    || !wl_global_create(display, &zwlr_layer_shell_v1_interface, 1, NULL, bind_layer_shell)
+	    || !wl_global_create(display, &zriver_status_manager_v1_interface, 4, NULL, bind_status_manager)
+	    || !wl_global_create(display, &zriver_control_v1_interface, 1, NULL, bind_control))
+		DIE("Could not create globals");
+	for (uint32_t i = 0; i < outputs_l; i++) {
+		Output *output = calloc(1, sizeof(Output));
+		if (!output)
+			EDIE("calloc");
+		output->index = i;
+		wl_list_init(&output->resources);
+		wl_list_init(&output->status_resources);
+		wl_list_insert(output_list.prev, &output->link);
+		add_output(output);
+	}
+
+	loop = wl_display_get_event_loop(display);
+	frame_timer = wl_event_loop_add_timer(loop, frame_timer_handler, NULL);
+	release_timer = wl_event_loop_add_timer(loop, release_timer_handler, NULL);
+	probe_timer = wl_event_loop_add_timer(loop, probe_timer_handler, NULL);
+	storm_timer = wl_event_loop_add_timer(loop, storm_timer_handler, NULL);
+	hotplug_timer = wl_event_loop_add_timer(loop, hotplug_timer_handler, NULL);
+	end_timer = wl_event_loop_add_timer(loop, end_timer_handler, NULL);
+	if (!frame_timer || !release_timer || !probe_timer || !storm_timer || !hotplug_timer || !end_timer
+	    || !wl_event_loop_add_signal(loop, SIGCHLD, handle_sigchld, NULL))
+		DIE("Could not add event sources");
+	wl_event_source_timer_update(frame_timer, MAX(1000 / refresh, 1));
+
+	/* The pipe may fill up under load; its reader is the one measured */
+	signal(SIGPIPE, SIG_IGN);
+	start_time = now_ns();
+	spawn(command, socket);
+
+	while (running) {
+		wl_display_flush_clients(display);
+		if (wl_event_loop_dispatch(loop, -1) == -1 && errno != EINTR)
+			EDIE("wl_event_loop_dispatch");
+	}
+
+	close(child_stdin);
+	if (child != -1) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
+	wl_display_destroy_clients(display);
+	wl_display_destroy(display);
+	if (own_runtime_dir)
+		rmdir(runtime_dir);
+	free(samples);
+	return 0;
+}
@@ -5,13 +5,24 @@
 #include <fcntl.h>
 #include <linux/input-event-codes.h>
 #include <pixman-1/pixman.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 #include <wayland-util.h>
@@ -25,6 +36,8 @@
 #include "wlr-layer-shell-unstable-v1-protocol.h"
 #include "river-status-unstable-v1-protocol.h"
 #include "river-control-unstable-v1-protocol.h"
+#include "fractional-scale-v1-protocol.h"
+#include "viewporter-protocol.h"
 
 #define DIE(fmt, ...)						\
 	do {							\
@@ -38,6 +51,8 @@
 	((a) < (b) ? (a) : (b))
 #define MAX(a, b)				\
 	((a) > (b) ? (a) : (b))
+#define LENGTH(x)				\
+	(sizeof(x) / sizeof((x)[0]))
 
 #define PROGRAM "sandbar"
 #define VERSION "0.2"
@@ -53,9 +68,25 @@
 	"	-no-mode				do not display the current mode\n" \
 	"	-hide-normal-mode			only display the current mode when it is not set to normal\n" \
 	"	-font [FONT]				specify a font\n" \
+	"	-prewarm [HEX[-HEX],...]		specify extra codepoints to rasterize at startup\n" \
+	"	-startup-trace				print the time taken by each startup phase\n" \
+	"	-stats					count frames, render times, statuses, buffers and glyphs\n" \
 	"	-tags [NUMBER OF TAGS] [FIRST]...[LAST]	specify custom tag names\n" \
 	"	-vertical-padding [PIXELS]		specify vertical pixel padding above and below text\n" \
-	"	-scale [BUFFER_SCALE]			specify buffer scale value for integer scaling\n" \
+	"	-scale [BUFFER_SCALE]			specify the integer scale of outputs that do not report one\n" \
+	"	-max-fps [FPS]				limit how often each bar is redrawn per second\n" \
+	"	-share-segments				copy parts already drawn on another output instead of drawing them\n" \
+	"	-subsurfaces				show the tags and the status on their own surfaces\n" \
+	"	-render-threads [NUMBER]		specify how many threads draw bars that are due at once (default 0, drawing on the main thread)\n" \
+	"	-max-line-length [BYTES]		specify the longest accepted input line\n" \
+	"	-line-overflow [discard|truncate]	drop or cut off lines exceeding the maximum length\n" \
+	"	-socket [PATH]				specify the path of the control socket\n" \
+	"	-no-socket				do not listen on a control socket\n" \
+	"	-binary					read framed binary commands from stdin\n" \
+	"	-module [NAME][:SECONDS]			append a built-in module to the status (load, memory, disk, battery, clock)\n" \
+	"	-clock-format [FORMAT]			specify the strftime format of the clock module\n" \
+	"	-disk-path [PATH]			specify the filesystem reported by the disk module\n" \
+	"	-battery [NAME]				specify the power supply reported by the battery module\n" \
 	"	-active-fg-color [RGBA]			specify text color of active tags or monitors\n" \
 	"	-active-bg-color [RGBA]			specify background color of active tags or monitors\n" \
 	"	-inactive-fg-color [RGBA]		specify text color of inactive tags or monitors\n" \
@@ -68,9 +99,260 @@
 	"	-v					get version information\n" \
 	"	-h					view this help text\n"
 
+#define BUFFERS 3
+
+/* Horizontal extent of one part of the bar (a tag, the title, ...) together
+ * with a hash of everything that determines its pixels */
 typedef struct {
-	struct wl_output *wl_output;
+	uint32_t x1, x2;
+	uint64_t hash;
+} Segment;
+
+typedef struct {
+	struct wl_buffer *wl_buffer;
+	pixman_image_t *image;
+	uint32_t *data;
+	bool busy;
+
+	/* Segments as currently drawn in this buffer */
+	Segment *segments;
+	uint32_t segments_l, segments_cap;
+} Buffer;
+
+enum { PART_TAG, PART_MODE, PART_LAYOUT, PART_TITLE, PART_FILL, PART_STATUS, PART_MODULE, PART_BLOCK };
+
+/* A rasterized glyph placed relative to the start of its part */
+typedef struct {
+	const struct fcft_glyph *glyph;
+	uint32_t x, x2;
+	pixman_color_t fg_color, bg_color;
+} Glyph;
+
+/* One laid out part of the bar. Tags and modes also carry their index in
+ * the tag array or seat list. */
+typedef struct {
+	int type;
+	uint32_t index;
+	uint32_t x1, x2;
+	uint32_t glyphs, glyphs_l;
+	uint64_t hash;
+} Part;
+
+/* Run of status codepoints sharing the same colors */
+typedef struct {
+	uint32_t start, len;
+	pixman_color_t fg_color, bg_color;
+} Span;
+
+/* Status text with its inline commands already applied, allocated as one
+ * block and never modified after compile_status() */
+typedef struct {
+	uint64_t hash;
+	Span *spans;
+	uint32_t spans_l;
+	uint32_t *codepoints;
+	uint32_t codepoints_l;
+} Status;
+
+/* Part boxes and glyph positions, kept until the text, the visible tags or
+ * the bar's width change */
+typedef struct {
+	Part *parts;
+	uint32_t parts_l, parts_cap;
+	Glyph *glyphs;
+	uint32_t glyphs_l, glyphs_cap;
+
+	struct fcft_font *font;
+	uint32_t width, visible_tags;
+	bool show_layout;
+} Layout;
+
+/* Glyphs of one piece of text laid out from x = 0 with no width limit, kept
+ * until the text or the bar's font changes. They are copied into the bar's
+ * layout as far as they fit. */
+typedef struct {
+	Layout layout;
+	uint32_t width;
+	uint64_t hash;
+	bool valid;
+} Measure;
+
+typedef struct {
+	struct wl_shm_pool *wl_shm_pool;
+	void *data;
+	size_t size;
+	uint32_t width, height, stride;
+	Buffer buffers[BUFFERS];
+	Buffer *last;
+} BufferPool;
+
+#define FILL_CACHE_SIZE 32
+
+/* Solid fill images keyed by their packed 64-bit color. Theme colors are
+ * pinned; colors from status text are evicted least recently used first. */
+typedef struct {
+	struct {
+		uint64_t key, used;
+		pixman_image_t *fill;
+		bool pinned;
+	} entries[FILL_CACHE_SIZE];
+	uint64_t clock;
+} FillCache;
+
+#define GLYPH_IMAGES_SIZE 256
+
+/* A render worker's own images on the pixels of glyph images, indexed by
+ * the glyph image's address. pixman does not make an image safe to use from
+ * several threads, so only the main thread composites glyph images
+ * themselves; workers read the same pixels through these. */
+typedef struct {
+	struct {
+		pixman_image_t *pix, *image;
+	} entries[GLYPH_IMAGES_SIZE];
+	uint64_t generation;
+} GlyphImages;
+
+/* File descriptor watched by the event loop. Timer sources own a timerfd
+ * whose expirations are consumed before the handler runs. */
+typedef struct EventSource {
+	int fd;
+	bool timer;
+	void (*handler)(struct EventSource *source, uint32_t events);
+	void *data;
+	struct wl_list link;
+} EventSource;
+
+/* Ring buffer mapped twice back to back, so that every line shorter than the
+ * ring is contiguous in memory and can be parsed in place, even when it wraps
+ * around the end */
+typedef struct {
+	char *data;
+	size_t size, max_line;
+	size_t start, len, scanned, skip;
+	bool discarding, binary;
+} LineReader;
+
+#define FRAME_HEADER_SIZE 8
+#define TARGET_ALL 0xffff
+#define TARGET_SELECTED 0xfffe
+
+/* Message of the binary protocol: an 8 byte header followed by a payload
+ * that may hold any bytes, newlines and NULs included */
+typedef struct {
+	uint8_t opcode;
+	uint16_t target;
+	uint32_t len;
+	char *payload;
+} Frame;
+
+typedef struct {
+	uint16_t id;
+	char *name;
+	struct wl_list link;
+} Binding;
+
+#define CLIENTS_MAX 64
+#define CLIENT_REPLY_SIZE 4096
+/* Room kept free in the reply buffer before running another command, which
+ * no single reply exceeds */
+#define CLIENT_REPLY_MAX (CLIENT_REPLY_SIZE / 2)
+
+/* Connection to the control socket. Replies that the client does not read
+ * pile up in reply; once that is nearly full, commands are left in the
+ * reader until they are sent. */
+typedef struct {
+	EventSource *source;
+	LineReader reader;
+	bool ack, eof;
+	char reply[CLIENT_REPLY_SIZE];
+	size_t reply_l;
+	struct wl_list link;
+} Client;
+
+/* Built-in status module, refreshed on its own timer. Its text is a part of
+ * its own after the status set through commands on every bar. */
+typedef struct {
+	const char *name;
+	void (*update)(char *buf, size_t size);
+	uint32_t interval;
+} ModuleType;
+
+typedef struct {
+	const ModuleType *type;
+	uint32_t interval;
+	EventSource *timer;
+	Status *status;
+	struct wl_list link;
+} Module;
+
+struct Bar;
+struct Surface;
+
+/* Drawing of one frame into a buffer, which runs on a render worker when
+ * several surfaces are due at once. Everything the drawing reads from the
+ * bar besides its layout is copied in, and the layout is left alone while
+ * the job is pending. */
+typedef struct {
+	struct Surface *surface;
+	Buffer *buffer;
+	uint32_t segments_l;
+	pixman_region32_t clip;
+	uint32_t x1, x2, origin;
+	uint32_t mtags, ctags, urg, height;
+	bool sel, done;
+	struct wl_list link;
+} RenderJob;
+
+#define SURFACES 3
+
+enum { SURFACE_MAIN, SURFACE_TAGS, SURFACE_STATUS };
+
+/* A wl_surface showing the parts of the bar between x1 and x2, with its own
+ * buffers and frame pacing. The main surface is the layer surface and its
+ * buffers span the whole bar. With -subsurfaces the tags and the status are
+ * shown by desynchronized subsurfaces on top of it, so that updating one
+ * only commits its own small buffer. Their buffers start at x1. */
+typedef struct Surface {
+	struct Bar *bar;
 	struct wl_surface *wl_surface;
+	struct wl_subsurface *wl_subsurface;
+	struct wp_viewport *viewport;
+	BufferPool pool;
+
+	uint32_t x1, x2, origin;
+	/* Position and width in surface-local coordinates of the main
+	 * surface */
+	uint32_t surface_x, surface_width;
+	bool mapped;
+	/* Set when surface state, e.g. a subsurface position, waits for a
+	 * commit */
+	bool uncommitted;
+
+	/* Segments of the current layout, in buffer coordinates */
+	Segment *segments;
+	uint32_t segments_l, segments_cap;
+
+	struct wl_callback *frame_callback;
+	uint64_t last_frame;
+	RenderJob job;
+	bool rendering;
+} Surface;
+
+/* Named piece of status text drawn right of the status. Its glyphs are
+ * measured once per text change and copied into the bar's layout, and it
+ * has its own part, so updating it only repaints its region. Blocks with
+ * the lowest priority are dropped first when the bar is too narrow. */
+typedef struct {
+	char *name;
+	int32_t priority;
+	Status *status;
+	Measure measure;
+	bool shown;
+	struct wl_list link;
+} Block;
+
+typedef struct Bar {
+	struct wl_output *wl_output;
 	struct zwlr_layer_surface_v1 *layer_surface;
 	struct zriver_output_status_v1 *river_output_status;
 	
@@ -78,20 +360,54 @@ typedef struct {
 	char *output_name;
 
 	bool configured;
+	uint32_t surface_width, surface_height;
 	uint32_t width, height;
 	uint32_t textpadding;
-	uint32_t stride, bufsize;
+	Surface surfaces[SURFACES];
+	uint32_t surfaces_l;
+
+	/* Scale in 120ths, as wp_fractional_scale_v1 reports it, and a font
+	 * loaded at the matching DPI */
+	uint32_t scale, output_scale;
+	struct fcft_font *font;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	/* Scale whose font is still loading, or 0 */
+	uint32_t pending_scale;
 	
 	uint32_t mtags, ctags, urg;
 	bool sel;
-	char *layout, *title, *status;
+	char *layout, *title;
+	Status *status;
+	char *pending_status;
+	size_t pending_status_l;
+	int32_t bind_id;
+	struct wl_list block_list;
+	Layout text_layout;
+	/* Measurements of each tag, each seat's mode, the layout symbol, the
+	 * title, the status and each module */
+	Measure *tag_measures, *mode_measures, *module_measures;
+	uint32_t tag_measures_l, mode_measures_l, module_measures_l;
+	Measure layout_measure, title_measure, status_measure;
 	
 	bool hidden, bottom;
-	bool redraw;
+	bool redraw, relayout;
+
+	uint32_t refresh;
+	/* Updates drawn, each counted once however many surfaces it took */
+	uint64_t frames;
 
 	struct wl_list link;
 } Bar;
 
+/* Command run on each targeted bar, which returns an error message or
+ * NULL; missing is the error for a command that requires data but got
+ * none */
+typedef struct {
+	const char *name;
+	const char *(*func)(Bar *bar, char *data, size_t len);
+	const char *missing;
+} Command;
+
 typedef struct {
 	struct wl_seat *wl_seat;
 	struct wl_pointer *wl_pointer;
@@ -101,6 +417,7 @@ typedef struct {
 	Bar *bar;
 	bool hovering;
 	uint32_t pointer_x, pointer_y;
+	uint32_t pointer_offset;
 	uint32_t pointer_button;
 
 	char *mode;
@@ -110,10 +427,13 @@ typedef struct {
 
 static struct wl_display *display;
 static struct wl_compositor *compositor;
+static struct wl_subcompositor *subcompositor;
 static struct wl_shm *shm;
 static struct zwlr_layer_shell_v1 *layer_shell;
 static struct zriver_status_manager_v1 *river_status_manager;
 static struct zriver_control_v1 *river_control;
+static struct wp_viewporter *viewporter;
+static struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 static struct wl_cursor_image *cursor_image;
 static struct wl_surface *cursor_surface;
 
@@ -124,7 +444,86 @@ static uint32_t tags_l;
 
 static char *fontstr = "monospace:size=16";
 static struct fcft_font *font;
-static uint32_t height, textpadding, vertical_padding = 1, buffer_scale = 1;
+
+#define FONT_CACHE_SIZE 4
+
+/* Fonts by scale in 120ths, which determines their DPI. Bars at the same
+ * scale share a font and its glyph cache. Unused fonts stay loaded until
+ * their slot is needed, so an output that comes back at a known scale does
+ * not reload one. */
+static struct {
+	uint32_t scale, refs;
+	struct fcft_font *font;
+} font_cache[FONT_CACHE_SIZE];
+
+/* Font being loaded at a scale no cached font matches. The thread loads it
+ * and warms its glyph cache, then signals font_efd; bars waiting for it keep
+ * their old font until then. */
+typedef struct {
+	uint32_t scale;
+	struct fcft_font *font;
+	pthread_t thread;
+	atomic_bool done;
+	struct wl_list link;
+} FontLoad;
+
+static struct wl_list font_loads;
+static int font_efd = -1;
+
+static uint32_t *prewarm_codepoints;
+static size_t prewarm_codepoints_l;
+static pthread_t prewarm_thread;
+static bool prewarm_started;
+static atomic_bool prewarm_stop;
+
+static pthread_t font_thread;
+static uint64_t font_load_time;
+
+static bool startup_trace;
+
+#define RENDER_BUCKETS 10
+
+/* Upper bounds of the render time histogram's buckets, in microseconds */
+static const uint32_t render_bucket_us[RENDER_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2000, 4000, 8000, 16000,
+};
+
+/* Counters for the stats command and SIGUSR1, only kept with -stats. Render
+ * workers and the prewarm thread add to them as well, hence the relaxed
+ * atomics. */
+static bool stats_enabled;
+static struct {
+	atomic_uint_fast64_t render_time[RENDER_BUCKETS], render_ns;
+	atomic_uint_fast64_t status_updates, status_superseded, status_unchanged, lines_dropped;
+	atomic_uint_fast64_t buffers_allocated, buffer_waits, redraws_skipped;
+	atomic_uint_fast64_t rasterizations, kerning_calls;
+	atomic_uint_fast64_t wakeups;
+} stats;
+
+#define STAT_ADD(counter, n)							\
+	do {									\
+		if (stats_enabled)						\
+			atomic_fetch_add_explicit(&stats.counter, (n), memory_order_relaxed); \
+	} while (0)
+
+static bool share_segments;
+static bool subsurfaces;
+
+static int render_threads;
+static pthread_t *render_workers;
+static int render_workers_l;
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_finished = PTHREAD_COND_INITIALIZER;
+static struct wl_list render_queue, render_done;
+static bool render_quit;
+static int render_efd = -1;
+/* Bumped whenever a font and its glyph images are destroyed, so that
+ * workers drop their images of them */
+static atomic_uint_fast64_t font_generation;
+static uint64_t startup_time;
+static uint32_t height, vertical_padding = 1, buffer_scale = 1;
+static uint32_t max_fps;
 
 static bool hidden, bottom, hide_vacant, no_title, no_status_commands, no_mode, no_layout, hide_normal_mode;
 
@@ -137,13 +536,55 @@ static pixman_color_t urgent_bg_color = { .red = 0xeeee, .green = 0xeeee, .blue
 static pixman_color_t title_fg_color = { .red = 0xeeee, .green = 0xeeee, .blue = 0xeeee, .alpha = 0xffff, };
 static pixman_color_t title_bg_color = { .red = 0x0000, .green = 0x5555, .blue = 0x7777, .alpha = 0xffff, };
 
+static FillCache fill_cache;
+
+static size_t max_line_length = 65536;
+static bool truncate_long_lines;
+static LineReader stdin_reader;
+static bool binary_stdin;
+
+static char *socket_path;
+static int socket_fd = -1;
+/* Set when stdin is a pipe or FIFO, whose end quits as it always did */
+static bool stdin_pipe;
+static bool no_socket;
+static struct wl_list client_list;
+static struct wl_list binding_list;
+
+static struct wl_list module_list;
+static char *clock_format = "%a %d %b %I:%M %P";
+static char *disk_path = "/";
+static char *battery = "BAT0";
+
+static int epoll_fd = -1;
+static struct wl_list source_list, removed_sources;
+static EventSource *frame_timer;
+
 static bool run_display;
 
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Prints how long after startup a phase ended, up to the first frame */
+static void
+trace_startup(const char *phase)
+{
+	if (startup_trace)
+		fprintf(stderr, "startup: %8.3f ms  %s\n", (now_ns() - startup_time) / 1e6, phase);
+}
+
 static void
 wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
 	/* Sent by the compositor when it's no longer using this buffer */
-	wl_buffer_destroy(wl_buffer);
+	Buffer *buffer = (Buffer *)data;
+
+	buffer->busy = false;
 }
 
 static const struct wl_buffer_listener wl_buffer_listener = {
@@ -168,6 +609,235 @@ allocate_shm_file(size_t size)
 	return fd;
 }
 
+static void
+pool_finish(BufferPool *pool)
+{
+	for (int i = 0; i < BUFFERS; i++) {
+		Buffer *buffer = &pool->buffers[i];
+		if (buffer->wl_buffer)
+			wl_buffer_destroy(buffer->wl_buffer);
+		if (buffer->image)
+			pixman_image_unref(buffer->image);
+		free(buffer->segments);
+	}
+	if (pool->wl_shm_pool)
+		wl_shm_pool_destroy(pool->wl_shm_pool);
+	if (pool->data)
+		munmap(pool->data, pool->size);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/* Maps one shm file holding BUFFERS frames of the given size. Buffers stay
+ * mapped and are handed out again once the compositor releases them. */
+static int
+pool_resize(BufferPool *pool, uint32_t width, uint32_t height)
+{
+	pool_finish(pool);
+
+	uint32_t stride = width * 4;
+	size_t bufsize = (size_t)stride * height;
+	size_t size = bufsize * BUFFERS;
+	
+	int fd = allocate_shm_file(size);
+	if (fd == -1)
+		return -1;
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	pool->wl_shm_pool = wl_shm_create_pool(shm, fd, size);
+	close(fd);
+	pool->data = data;
+	pool->size = size;
+	pool->width = width;
+	pool->height = height;
+	pool->stride = stride;
+
+	for (int i = 0; i < BUFFERS; i++) {
+		Buffer *buffer = &pool->buffers[i];
+		buffer->data = (uint32_t *)((char *)data + bufsize * i);
+		buffer->wl_buffer = wl_shm_pool_create_buffer(pool->wl_shm_pool, bufsize * i, width, height,
+							      stride, WL_SHM_FORMAT_ARGB8888);
+		wl_buffer_add_listener(buffer->wl_buffer, &wl_buffer_listener, buffer);
+		buffer->image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, buffer->data, stride);
+	}
+	STAT_ADD(buffers_allocated, BUFFERS);
+
+	return 0;
+}
+
+static Buffer *
+pool_get_buffer(BufferPool *pool)
+{
+	/* The last committed buffer needs the least repainting */
+	if (pool->last && !pool->last->busy)
+		return pool->last;
+	for (int i = 0; i < BUFFERS; i++)
+		if (pool->buffers[i].wl_buffer && !pool->buffers[i].busy)
+			return &pool->buffers[i];
+	return NULL;
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	Surface *surface = (Surface *)data;
+
+	wl_callback_destroy(callback);
+	surface->frame_callback = NULL;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+static pixman_image_t *
+get_fill(FillCache *cache, const pixman_color_t *color, bool pin)
+{
+	uint64_t key = (uint64_t)color->red << 48 | (uint64_t)color->green << 32
+		| (uint64_t)color->blue << 16 | color->alpha;
+
+	int victim = -1;
+	for (int i = 0; i < FILL_CACHE_SIZE; i++) {
+		if (cache->entries[i].fill && cache->entries[i].key == key) {
+			cache->entries[i].used = ++cache->clock;
+			cache->entries[i].pinned |= pin;
+			return cache->entries[i].fill;
+		}
+		if (cache->entries[i].pinned)
+			continue;
+		if (victim == -1 || !cache->entries[i].fill
+		    || (cache->entries[victim].fill && cache->entries[i].used < cache->entries[victim].used))
+			victim = i;
+	}
+
+	/* Only the four theme text colors are pinned, so there is always
+	 * an entry to evict */
+	pixman_image_t *fill = pixman_image_create_solid_fill(color);
+	if (cache->entries[victim].fill)
+		pixman_image_unref(cache->entries[victim].fill);
+	cache->entries[victim].key = key;
+	cache->entries[victim].fill = fill;
+	cache->entries[victim].used = ++cache->clock;
+	cache->entries[victim].pinned = pin;
+	return fill;
+}
+
+/* Returns the worker's image on the pixels of a glyph image, or the glyph
+ * image itself on the main thread, where images is NULL */
+static pixman_image_t *
+glyph_image(GlyphImages *images, pixman_image_t *pix)
+{
+	if (!images)
+		return pix;
+
+	uint64_t generation = atomic_load_explicit(&font_generation, memory_order_relaxed);
+	if (images->generation != generation) {
+		for (int i = 0; i < GLYPH_IMAGES_SIZE; i++)
+			if (images->entries[i].image)
+				pixman_image_unref(images->entries[i].image);
+		memset(images->entries, 0, sizeof(images->entries));
+		images->generation = generation;
+	}
+
+	size_t i = (uintptr_t)pix / 64 % GLYPH_IMAGES_SIZE;
+	if (images->entries[i].pix != pix) {
+		/* The getters only read what fcft set up when it created the
+		 * glyph, never what pixman computes lazily */
+		pixman_image_t *image = pixman_image_create_bits(
+			pixman_image_get_format(pix), pixman_image_get_width(pix), pixman_image_get_height(pix),
+			pixman_image_get_data(pix), pixman_image_get_stride(pix));
+		if (!image)
+			DIE("pixman_image_create_bits");
+		if (images->entries[i].image)
+			pixman_image_unref(images->entries[i].image);
+		images->entries[i].pix = pix;
+		images->entries[i].image = image;
+	}
+	return images->entries[i].image;
+}
+
+static void
+glyph_images_finish(GlyphImages *images)
+{
+	for (int i = 0; i < GLYPH_IMAGES_SIZE; i++)
+		if (images->entries[i].image)
+			pixman_image_unref(images->entries[i].image);
+	memset(images, 0, sizeof(*images));
+}
+
+static void
+fill_cache_finish(FillCache *cache)
+{
+	for (int i = 0; i < FILL_CACHE_SIZE; i++)
+		if (cache->entries[i].fill)
+			pixman_image_unref(cache->entries[i].fill);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* FNV-1a */
+#define HASH_INIT 0xcbf29ce484222325ull
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	for (const unsigned char *p = data; len--; p++)
+		hash = (hash ^ *p) * 0x100000001b3ull;
+	return hash;
+}
+
+static uint64_t
+hash_string(uint64_t hash, const char *str)
+{
+	return str ? hash_bytes(hash, str, strlen(str) + 1) : hash_bytes(hash, "", 1);
+}
+
+static bool
+segment_drawn(const Segment *segments, uint32_t segments_l, const Segment *segment)
+{
+	/* Segments are stored in ascending, non-overlapping order */
+	uint32_t lo = 0, hi = segments_l;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (segments[mid].x1 < segment->x1)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < segments_l && segments[lo].x1 == segment->x1
+		&& segments[lo].x2 == segment->x2 && segments[lo].hash == segment->hash;
+}
+
+/* Copies a segment into the buffer from any other buffer, of this bar or
+ * another one of the same height, that already holds it. Identical bars on
+ * several outputs thus only draw each shared segment once. */
+static bool
+copy_segment(Buffer *buffer, uint32_t height, const Segment *segment)
+{
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		for (uint32_t i = 0; i < bar->surfaces_l; i++) {
+			BufferPool *pool = &bar->surfaces[i].pool;
+			if (pool->height != height)
+				continue;
+			for (int j = 0; j < BUFFERS; j++) {
+				Buffer *source = &pool->buffers[j];
+				if (source == buffer || !source->image
+				    || !segment_drawn(source->segments, source->segments_l, segment))
+					continue;
+				pixman_image_composite32(PIXMAN_OP_SRC, source->image, NULL, buffer->image,
+							 segment->x1, 0, 0, 0, segment->x1, 0,
+							 segment->x2 - segment->x1, height);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 /* Color parsing logic adapted from [sway] */
 static int
 parse_color(const char *str, pixman_color_t *clr)
@@ -197,75 +867,156 @@ parse_color(const char *str, pixman_color_t *clr)
 	return 0;
 }
 
+static void
+fill_span(pixman_image_t *image, pixman_op_t op, pixman_color_t *color,
+	  int32_t x1, int32_t x2, uint32_t buf_height)
+{
+	if (x1 < x2)
+		pixman_image_fill_boxes(op, image, color, 1, &(pixman_box32_t){
+				.x1 = x1, .x2 = x2,
+				.y1 = 0, .y2 = buf_height
+			});
+}
+
+/* Rasterizes one codepoint at the pen position x and appends it to the
+ * layout. Returns false once the glyph would not fit before max_x. */
+static bool
+layout_glyph(Layout *layout, uint32_t *x, uint32_t *last_cp, uint32_t codepoint,
+	     pixman_color_t *fg_color, pixman_color_t *bg_color,
+	     uint32_t max_x, uint32_t padding)
+{
+	/* Turn off subpixel rendering, which complicates things when
+	 * mixed with alpha channels */
+	const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(layout->font, codepoint, FCFT_SUBPIXEL_NONE);
+	STAT_ADD(rasterizations, 1);
+	if (!glyph)
+		return true;
+
+	/* Adjust x position based on kerning with previous glyph */
+	long kern = 0;
+	uint32_t nx;
+	if (*last_cp) {
+		fcft_kerning(layout->font, *last_cp, codepoint, &kern, NULL);
+		STAT_ADD(kerning_calls, 1);
+	}
+	if ((nx = *x + kern + glyph->advance.x) + padding > max_x)
+		return false;
+	*last_cp = codepoint;
+	*x += kern;
+
+	if (layout->glyphs_l == layout->glyphs_cap) {
+		layout->glyphs_cap = layout->glyphs_cap ? layout->glyphs_cap * 2 : 64;
+		if (!(layout->glyphs = realloc(layout->glyphs, layout->glyphs_cap * sizeof(Glyph))))
+			EDIE("realloc");
+	}
+	layout->glyphs[layout->glyphs_l++] = (Glyph){
+		.glyph = glyph, .x = *x, .x2 = nx,
+		.fg_color = *fg_color, .bg_color = *bg_color,
+	};
+
+	/* increment pen position */
+	*x = nx;
+	return true;
+}
+
+/* Rasterizes text into the layout's glyph array, starting at x = 0, and
+ * returns its width including padding, or 0 if nothing fits before max_x */
 static uint32_t
-draw_text(char *text,
-	  uint32_t x,
-	  uint32_t y,
-	  pixman_image_t *foreground,
-	  pixman_image_t *background,
-	  pixman_color_t *fg_color,
-	  pixman_color_t *bg_color,
-	  uint32_t max_x,
-	  uint32_t buf_height,
-	  uint32_t padding,
-	  bool commands)
-{
-	if (!text || !*text || !max_x)
-		return x;
-
-	uint32_t ix = x, nx;
-
-	if ((nx = x + padding) + padding >= max_x)
-		return x;
-	x = nx;
-
-	bool draw_fg = foreground && fg_color;
-	bool draw_bg = background && bg_color;
-
-	pixman_image_t *fg_fill;
-	pixman_color_t cur_bg_color;
-	if (draw_fg)
-		fg_fill = pixman_image_create_solid_fill(fg_color);
-	if (draw_bg)
-		cur_bg_color = *bg_color;
+layout_text(Layout *layout,
+	    char *text,
+	    pixman_color_t *fg_color,
+	    pixman_color_t *bg_color,
+	    uint32_t max_x,
+	    uint32_t padding)
+{
+	if (!text || !*text || !max_x || padding * 2 >= max_x)
+		return 0;
 
+	uint32_t x = padding, glyphs = layout->glyphs_l;
 	uint32_t codepoint, state = UTF8_ACCEPT, last_cp = 0;
 	for (char *p = text; *p; p++) {
+		/* Returns nonzero if more bytes are needed */
+		if (utf8decode(&state, &codepoint, *p))
+			continue;
+		if (!layout_glyph(layout, &x, &last_cp, codepoint, fg_color, bg_color, max_x, padding))
+			break;
+	}
+	
+	return layout->glyphs_l == glyphs ? 0 : x + padding;
+}
+
+/* Same as layout_text() for compiled status text */
+static uint32_t
+layout_status(Layout *layout,
+	      Status *status,
+	      uint32_t max_x,
+	      uint32_t padding)
+{
+	if (!status || !status->codepoints_l || !max_x || padding * 2 >= max_x)
+		return 0;
+
+	uint32_t x = padding, glyphs = layout->glyphs_l, last_cp = 0;
+	for (uint32_t i = 0; i < status->spans_l; i++) {
+		Span *span = &status->spans[i];
+		for (uint32_t j = 0; j < span->len; j++)
+			if (!layout_glyph(layout, &x, &last_cp, status->codepoints[span->start + j],
+					  &span->fg_color, &span->bg_color, max_x, padding))
+				goto done;
+	}
+
+done:
+	return layout->glyphs_l == glyphs ? 0 : x + padding;
+}
+
+/* Decodes status text and applies its inline ^fg()/^bg() commands, unless
+ * commands is unset, so that drawing only has to walk the resulting spans */
+static Status *
+compile_status(const char *text, size_t len, bool commands)
+{
+	/* No more codepoints or spans than there are bytes */
+	Status *status = malloc(sizeof(Status) + (len + 1) * (sizeof(Span) + sizeof(uint32_t)));
+	if (!status)
+		EDIE("malloc");
+	status->hash = hash_bytes(HASH_INIT, text, len);
+	status->spans = (Span *)(status + 1);
+	status->codepoints = (uint32_t *)(status->spans + len + 1);
+	status->spans_l = status->codepoints_l = 0;
+
+	pixman_color_t fg_color = inactive_fg_color, bg_color = inactive_bg_color;
+	Span *span = NULL;
+
+	uint32_t codepoint, state = UTF8_ACCEPT;
+	const char *text_end = text + len;
+	for (const char *p = text; p < text_end; p++) {
 		/* Check for inline ^ commands */
-		if (!no_status_commands && commands && state == UTF8_ACCEPT && *p == '^') {
-			p++;
+		if (commands && !no_status_commands && state == UTF8_ACCEPT && *p == '^') {
+			if (++p == text_end)
+				break;
 			if (*p != '^') {
 				/* Parse color */
-				char *arg, *end;
-				if (!(arg = strchr(p, '(')) || !(end = strchr(arg + 1, ')')))
+				const char *arg, *end;
+				if (!(arg = memchr(p, '(', text_end - p))
+				    || !(end = memchr(arg + 1, ')', text_end - arg - 1)))
 					continue;
-				*arg++ = '\0';
-				*end = '\0';
-				if (!strcmp(p, "bg")) {
-					if (draw_bg) {
-						if (!*arg)
-							cur_bg_color = *bg_color;
-						else
-							parse_color(arg, &cur_bg_color);
-					}
-				} else if (!strcmp(p, "fg")) {
-					if (draw_fg) {
-						pixman_color_t color;
-						bool refresh = true;
-						if (!*arg)
-							color = *fg_color;
-						else if (parse_color(arg, &color) == -1)
-							refresh = false;
-						if (refresh) {
-							pixman_image_unref(fg_fill);
-							fg_fill = pixman_image_create_solid_fill(&color);
-						}
+				size_t cmd_len = arg - p, arg_len = end - ++arg;
+				pixman_color_t *target = NULL, *fallback;
+				if (cmd_len == 2 && !strncmp(p, "bg", 2)) {
+					target = &bg_color;
+					fallback = &inactive_bg_color;
+				} else if (cmd_len == 2 && !strncmp(p, "fg", 2)) {
+					target = &fg_color;
+					fallback = &inactive_fg_color;
+				}
+				if (target) {
+					char buf[16];
+					if (!arg_len) {
+						*target = *fallback;
+					} else if (arg_len < sizeof(buf)) {
+						memcpy(buf, arg, arg_len);
+						buf[arg_len] = '\0';
+						parse_color(buf, target);
 					}
 				}
-
-				/* Restore string for later redraws */
-				*--arg = '(';
-				*end = ')';
 				p = end;
 				continue;
 			}
@@ -275,200 +1026,845 @@ draw_text(char *text,
 		if (utf8decode(&state, &codepoint, *p))
 			continue;
 
-		/* Turn off subpixel rendering, which complicates things when
-		 * mixed with alpha channels */
-		const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
-		if (!glyph)
-			continue;
-
-		/* Adjust x position based on kerning with previous glyph */
-		long kern = 0;
-		if (last_cp)
-			fcft_kerning(font, last_cp, codepoint, &kern, NULL);
-		if ((nx = x + kern + glyph->advance.x) + padding > max_x)
-			break;
-		last_cp = codepoint;
-		x += kern;
-
-		if (draw_fg) {
-			/* Detect and handle pre-rendered glyphs (e.g. emoji) */
-			if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
-				/* Only the alpha channel of the mask is used, so we can
-				 * use fgfill here to blend prerendered glyphs with the
-				 * same opacity */
-				pixman_image_composite32(
-					PIXMAN_OP_OVER, glyph->pix, fg_fill, foreground, 0, 0, 0, 0,
-					x + glyph->x, y - glyph->y, glyph->width, glyph->height);
-			} else {
-				/* Applying the foreground color here would mess up
-				 * component alphas for subpixel-rendered text, so we
-				 * apply it when blending. */
-				pixman_image_composite32(
-					PIXMAN_OP_OVER, fg_fill, glyph->pix, foreground, 0, 0, 0, 0,
-					x + glyph->x, y - glyph->y, glyph->width, glyph->height);
-			}
-		}
-		
-		if (draw_bg) {
-			pixman_image_fill_boxes(PIXMAN_OP_OVER, background,
-						&cur_bg_color, 1, &(pixman_box32_t){
-							.x1 = x, .x2 = nx,
-							.y1 = 0, .y2 = buf_height
-						});
+		if (!span || memcmp(&span->fg_color, &fg_color, sizeof(fg_color))
+		    || memcmp(&span->bg_color, &bg_color, sizeof(bg_color))) {
+			span = &status->spans[status->spans_l++];
+			*span = (Span){
+				.start = status->codepoints_l,
+				.fg_color = fg_color, .bg_color = bg_color,
+			};
 		}
-		
-		/* increment pen position */
-		x = nx;
+		status->codepoints[status->codepoints_l++] = codepoint;
+		span->len++;
 	}
-	
-	if (draw_fg)
-		pixman_image_unref(fg_fill);
-	if (!last_cp)
-		return ix;
-	
-	nx = x + padding;
-	if (draw_bg) {
-		/* Fill padding background */
-		pixman_image_fill_boxes(PIXMAN_OP_OVER, background,
-					bg_color, 1, &(pixman_box32_t){
-						.x1 = ix, .x2 = ix + padding,
-						.y1 = 0, .y2 = buf_height
-					});
-		pixman_image_fill_boxes(PIXMAN_OP_OVER, background,
-					bg_color, 1, &(pixman_box32_t){
-						.x1 = x, .x2 = nx,
-						.y1 = 0, .y2 = buf_height
-					});
+
+	return status;
+}
+
+static void
+add_part(Layout *layout, int type, uint32_t index, uint32_t x1, uint32_t x2,
+	 uint32_t glyphs, uint64_t hash)
+{
+	if (x1 >= x2)
+		return;
+	if (layout->parts_l == layout->parts_cap) {
+		layout->parts_cap = layout->parts_cap ? layout->parts_cap * 2 : 16;
+		if (!(layout->parts = realloc(layout->parts, layout->parts_cap * sizeof(Part))))
+			EDIE("realloc");
 	}
-	
-	return nx;
+	layout->parts[layout->parts_l++] = (Part){
+		.type = type, .index = index, .x1 = x1, .x2 = x2,
+		.glyphs = glyphs, .glyphs_l = layout->glyphs_l - glyphs, .hash = hash,
+	};
 }
 
-#define TEXT_WIDTH(text, maxwidth, padding, commands)			\
-	draw_text(text, 0, 0, NULL, NULL, NULL, NULL, maxwidth, 0, padding, commands)
+/* Lays out text into a measurement, unless it already holds the same text */
+static void
+measure_text(Bar *bar, Measure *measure, char *text)
+{
+	uint64_t hash = hash_string(HASH_INIT, text);
+	if (measure->valid && measure->hash == hash)
+		return;
+	measure->layout.glyphs_l = 0;
+	measure->layout.font = bar->font;
+	measure->width = layout_text(&measure->layout, text, &inactive_fg_color, &inactive_bg_color,
+				     UINT32_MAX, bar->textpadding);
+	measure->hash = hash;
+	measure->valid = true;
+}
 
-static int
-draw_frame(Bar *bar)
+/* Same as measure_text() for compiled status text */
+static void
+measure_status(Bar *bar, Measure *measure, Status *status)
 {
-	/* Allocate buffer to be attached to the surface */
-        int fd = allocate_shm_file(bar->bufsize);
-	if (fd == -1)
-		return -1;
+	uint64_t hash = status ? status->hash : HASH_INIT;
+	if (measure->valid && measure->hash == hash)
+		return;
+	measure->layout.glyphs_l = 0;
+	measure->layout.font = bar->font;
+	measure->width = layout_status(&measure->layout, status, UINT32_MAX, bar->textpadding);
+	measure->hash = hash;
+	measure->valid = true;
+}
 
-	uint32_t *data = mmap(NULL, bar->bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		close(fd);
-		return -1;
+/* Returns the width, padding included, of the glyphs of a measurement that
+ * fit before max_x, cut off where layout_text() would have stopped, and
+ * their number in count */
+static uint32_t
+fit_measure(Measure *measure, uint32_t max_x, uint32_t padding, uint32_t *count)
+{
+	*count = 0;
+	if (!max_x || padding * 2 >= max_x)
+		return 0;
+	Glyph *glyphs = measure->layout.glyphs;
+	while (*count < measure->layout.glyphs_l && glyphs[*count].x2 + padding <= max_x)
+		(*count)++;
+	return *count ? glyphs[*count - 1].x2 + padding : 0;
+}
+
+/* Copies the first count glyphs of a measurement into the layout as a part
+ * starting at x */
+static void
+add_measure_part(Layout *layout, Measure *measure, uint32_t count, int type, uint32_t index,
+		 uint32_t x, uint32_t width, uint64_t hash)
+{
+	uint32_t glyphs = layout->glyphs_l;
+	if (layout->glyphs_l + count > layout->glyphs_cap) {
+		while (layout->glyphs_l + count > layout->glyphs_cap)
+			layout->glyphs_cap = layout->glyphs_cap ? layout->glyphs_cap * 2 : 64;
+		if (!(layout->glyphs = realloc(layout->glyphs, layout->glyphs_cap * sizeof(Glyph))))
+			EDIE("realloc");
 	}
+	memcpy(&layout->glyphs[layout->glyphs_l], measure->layout.glyphs, count * sizeof(Glyph));
+	layout->glyphs_l += count;
+	add_part(layout, type, index, x, x + width, glyphs, hash);
+}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, bar->bufsize);
-	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, bar->width, bar->height, bar->stride, WL_SHM_FORMAT_ARGB8888);
-	wl_buffer_add_listener(buffer, &wl_buffer_listener, NULL);
-	wl_shm_pool_destroy(pool);
-	close(fd);
+/* Same as add_measure_part() for as many glyphs as fit before max_x;
+ * returns the width of the part */
+static uint32_t
+place_measure(Layout *layout, Measure *measure, int type, uint32_t index, uint32_t x,
+	      uint32_t max_x, uint32_t padding, uint64_t hash)
+{
+	uint32_t count, width = fit_measure(measure, max_x, padding, &count);
+	add_measure_part(layout, measure, count, type, index, x, width, hash);
+	return width;
+}
+
+/* Grows an array of measurements to hold at least n, the new ones unset */
+static void
+reserve_measures(Measure **measures, uint32_t *measures_l, uint32_t n)
+{
+	if (n <= *measures_l)
+		return;
+	if (!(*measures = realloc(*measures, n * sizeof(Measure))))
+		EDIE("realloc");
+	memset(*measures + *measures_l, 0, (n - *measures_l) * sizeof(Measure));
+	*measures_l = n;
+}
+
+/* Drops the measurements made with the bar's old font */
+static void
+invalidate_measures(Bar *bar)
+{
+	for (uint32_t i = 0; i < bar->tag_measures_l; i++)
+		bar->tag_measures[i].valid = false;
+	for (uint32_t i = 0; i < bar->mode_measures_l; i++)
+		bar->mode_measures[i].valid = false;
+	for (uint32_t i = 0; i < bar->module_measures_l; i++)
+		bar->module_measures[i].valid = false;
+	bar->layout_measure.valid = bar->title_measure.valid = bar->status_measure.valid = false;
+	Block *block;
+	wl_list_for_each(block, &bar->block_list, link)
+		block->measure.valid = false;
+}
+
+static void
+free_measure(Measure *measure)
+{
+	free(measure->layout.glyphs);
+}
+
+static void
+free_measures(Bar *bar)
+{
+	for (uint32_t i = 0; i < bar->tag_measures_l; i++)
+		free_measure(&bar->tag_measures[i]);
+	for (uint32_t i = 0; i < bar->mode_measures_l; i++)
+		free_measure(&bar->mode_measures[i]);
+	for (uint32_t i = 0; i < bar->module_measures_l; i++)
+		free_measure(&bar->module_measures[i]);
+	free(bar->tag_measures);
+	free(bar->mode_measures);
+	free(bar->module_measures);
+	free_measure(&bar->layout_measure);
+	free_measure(&bar->title_measure);
+	free_measure(&bar->status_measure);
+}
+
+static uint32_t
+visible_tags(Bar *bar)
+{
+	if (!hide_vacant)
+		return ~0u;
+	return bar->mtags | bar->ctags | bar->urg;
+}
+
+/* Lays out every part of the bar from left to right, copying each part's
+ * glyphs from its measurement, which is only redone when its text or the
+ * font changes. The status is fitted before the title, which is cut off
+ * where the right-aligned status begins. */
+static void
+update_layout(Bar *bar)
+{
+	Layout *layout = &bar->text_layout;
+	layout->parts_l = layout->glyphs_l = 0;
+	layout->font = bar->font;
+	layout->width = bar->width;
+	layout->visible_tags = visible_tags(bar);
+	layout->show_layout = bar->mtags & bar->ctags;
+	bar->relayout = false;
 
-	/* Pixman image corresponding to main buffer */
-	pixman_image_t *final = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, data, bar->width * 4);
-	
-	/* Text background and foreground layers */
-	pixman_image_t *foreground = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, NULL, bar->width * 4);
-	pixman_image_t *background = pixman_image_create_bits(PIXMAN_a8r8g8b8, bar->width, bar->height, NULL, bar->width * 4);
-	
-	/* Draw on images */
 	uint32_t x = 0;
-	uint32_t y = (bar->height + font->ascent - font->descent) / 2;
-	uint32_t boxs = font->height / 9;
-	uint32_t boxw = font->height / 6 + 2;
-	
+
+	reserve_measures(&bar->tag_measures, &bar->tag_measures_l, tags_l);
 	for (uint32_t i = 0; i < tags_l; i++) {
-		const bool active = bar->mtags & 1 << i;
-		const bool occupied = bar->ctags & 1 << i;
-		const bool urgent = bar->urg & 1 << i;
-		
-		if (hide_vacant && !active && !occupied && !urgent)
+		if (!(layout->visible_tags & 1 << i))
 			continue;
-
-		pixman_color_t *fg_color = urgent ? &urgent_fg_color : (active ? &active_fg_color : &inactive_fg_color);
-		pixman_color_t *bg_color = urgent ? &urgent_bg_color : (active ? &active_bg_color : &inactive_bg_color);
-		
-		if (!hide_vacant && occupied) {
-			pixman_image_fill_boxes(PIXMAN_OP_SRC, foreground,
-						fg_color, 1, &(pixman_box32_t){
-							.x1 = x + boxs, .x2 = x + boxs + boxw,
-							.y1 = boxs, .y2 = boxs + boxw
-						});
-			if ((!bar->sel || !active) && boxw >= 3) {
-				/* Make box hollow */
-				pixman_image_fill_boxes(PIXMAN_OP_SRC, foreground,
-							&(pixman_color_t){ 0 },
-							1, &(pixman_box32_t){
-								.x1 = x + boxs + 1, .x2 = x + boxs + boxw - 1,
-								.y1 = boxs + 1, .y2 = boxs + boxw - 1
-							});
-			}
-		}
-		
-		x = draw_text(tags[i], x, y, foreground, background, fg_color, bg_color,
-			      bar->width, bar->height, bar->textpadding, false);
+		/* Tag colors depend on state; they are picked when drawing */
+		Measure *measure = &bar->tag_measures[i];
+		measure_text(bar, measure, tags[i]);
+		x += place_measure(layout, measure, PART_TAG, i, x, bar->width - x, bar->textpadding,
+				   measure->hash);
 	}
 
 	if (!no_mode) {
 		Seat *seat;
+		uint32_t i = 0;
+		reserve_measures(&bar->mode_measures, &bar->mode_measures_l, wl_list_length(&seat_list));
 		wl_list_for_each(seat, &seat_list, link) {
 			if ((hide_normal_mode && (seat->mode != NULL && strcmp(seat->mode, "normal") != 0)) || !hide_normal_mode) {
-				x = draw_text(seat->mode, x, y, foreground, background,
-						  &inactive_fg_color, &inactive_bg_color, bar->width,
-						  bar->height, bar->textpadding, false);
+				Measure *measure = &bar->mode_measures[i];
+				measure_text(bar, measure, seat->mode);
+				x += place_measure(layout, measure, PART_MODE, i, x, bar->width - x, bar->textpadding,
+						   hash_string(hash_string(HASH_INIT, "mode"), seat->mode));
 			}
+			i++;
 		}
 	}
 
 	if (!no_layout) {
-		if (bar->mtags & bar->ctags) {
-			x = draw_text(bar->layout, x, y, foreground, background,
-					  &inactive_fg_color, &inactive_bg_color, bar->width,
-					  bar->height, bar->textpadding, false);
+		if (layout->show_layout) {
+			measure_text(bar, &bar->layout_measure, bar->layout);
+			x += place_measure(layout, &bar->layout_measure, PART_LAYOUT, 0, x, bar->width - x,
+					   bar->textpadding, hash_string(hash_string(HASH_INIT, "layout"), bar->layout));
 		}
 	}
 	
-	uint32_t status_width = TEXT_WIDTH(bar->status, bar->width - x, bar->textpadding, true);
-	draw_text(bar->status, bar->width - status_width, y, foreground,
-		  background, &inactive_fg_color, &inactive_bg_color,
-		  bar->width, bar->height, bar->textpadding, true);
+	/* The status set through commands and each module are parts of their
+	 * own, which are measured only when their text changes */
+	uint32_t modules_l = wl_list_length(&module_list);
+	reserve_measures(&bar->module_measures, &bar->module_measures_l, modules_l);
+	Measure *pieces[1 + modules_l];
+	uint32_t pieces_l = 0;
+	pieces[pieces_l++] = &bar->status_measure;
+	measure_status(bar, &bar->status_measure, bar->status);
+	Module *module;
+	wl_list_for_each(module, &module_list, link) {
+		Measure *measure = &bar->module_measures[pieces_l - 1];
+		measure_status(bar, measure, module->status);
+		pieces[pieces_l++] = measure;
+	}
 
-	if (!no_title) {
-		x = draw_text(bar->title, x, y, foreground, background,
-			      bar->sel ? &title_fg_color : &inactive_fg_color,
-			      bar->sel ? &title_bg_color : &inactive_bg_color,
-			      bar->width - status_width, bar->height, bar->textpadding,
-			      false);
-	}
-
-	pixman_image_fill_boxes(PIXMAN_OP_SRC, background,
-				bar->sel ? &title_bg_color : &title_bg_color, 1,
-				&(pixman_box32_t){
-					.x1 = x, .x2 = bar->width - status_width,
-					.y1 = 0, .y2 = bar->height
-				});
-
-	/* Draw background and foreground on bar */
-	pixman_image_composite32(PIXMAN_OP_OVER, background, NULL, final, 0, 0, 0, 0, 0, 0, bar->width, bar->height);
-	pixman_image_composite32(PIXMAN_OP_OVER, foreground, NULL, final, 0, 0, 0, 0, 0, 0, bar->width, bar->height);
-
-	pixman_image_unref(foreground);
-	pixman_image_unref(background);
-	pixman_image_unref(final);
-	
-	munmap(data, bar->bufsize);
+	/* Blocks keep their measurement until their text changes. The ones
+	 * with the lowest priority, rightmost first, are dropped until the rest
+	 * fit next to the left-hand parts. */
+	Block *block, *drop;
+	uint32_t blocks_width = 0;
+	wl_list_for_each(block, &bar->block_list, link) {
+		measure_status(bar, &block->measure, block->status);
+		block->shown = block->measure.width;
+		blocks_width += block->measure.width;
+	}
+	while (blocks_width > bar->width - x) {
+		drop = NULL;
+		wl_list_for_each(block, &bar->block_list, link)
+			if (block->shown && (!drop || block->priority <= drop->priority))
+				drop = block;
+		blocks_width -= drop->measure.width;
+		drop->shown = false;
+	}
+
+	/* The status and then the modules take what is left, so that the
+	 * last module is the first to be cut off */
+	uint32_t widths[pieces_l], counts[pieces_l], status_width = 0;
+	for (uint32_t i = 0; i < pieces_l; i++) {
+		widths[i] = fit_measure(pieces[i], bar->width - x - blocks_width - status_width,
+					bar->textpadding, &counts[i]);
+		status_width += widths[i];
+	}
+	uint32_t status_x = bar->width - blocks_width - status_width;
+
+	if (!no_title) {
+		/* Title colors depend on whether the bar is selected */
+		measure_text(bar, &bar->title_measure, bar->title);
+		x += place_measure(layout, &bar->title_measure, PART_TITLE, 0, x, status_x - x,
+				   bar->textpadding, hash_string(hash_string(HASH_INIT, "title"), bar->title));
+	}
+
+	add_part(layout, PART_FILL, 0, x, status_x, layout->glyphs_l, hash_string(HASH_INIT, "fill"));
+
+	x = status_x;
+	add_measure_part(layout, pieces[0], counts[0], PART_STATUS, 0, x, widths[0],
+			 bar->status_measure.hash);
+	x += widths[0];
+	uint32_t i = 0;
+	wl_list_for_each(module, &module_list, link) {
+		i++;
+		add_measure_part(layout, pieces[i], counts[i], PART_MODULE, i - 1, x, widths[i],
+				 hash_bytes(hash_string(HASH_INIT, module->type->name),
+					    &pieces[i]->hash, sizeof(pieces[i]->hash)));
+		x += widths[i];
+	}
+
+	i = 0;
+	wl_list_for_each(block, &bar->block_list, link) {
+		i++;
+		if (!block->shown)
+			continue;
+		add_measure_part(layout, &block->measure, block->measure.layout.glyphs_l, PART_BLOCK, i - 1,
+				 x, block->measure.width,
+				 hash_bytes(hash_string(HASH_INIT, block->name),
+					    &block->status->hash, sizeof(block->status->hash)));
+		x += block->measure.width;
+	}
+}
+
+/* Returns the part at x (in buffer pixels) by binary search, or NULL */
+static Part *
+layout_part_at(Layout *layout, uint32_t x)
+{
+	uint32_t lo = 0, hi = layout->parts_l;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		Part *part = &layout->parts[mid];
+		if (x < part->x1)
+			hi = mid;
+		else if (x >= part->x2)
+			lo = mid + 1;
+		else
+			return part;
+	}
+	return NULL;
+}
+
+/* Fills the background of a part the way the separate background layer of
+ * old did: the padding on either side and each glyph's box, from its pen
+ * position to the next, are blended in that order over a transparent part.
+ * Gaps left by positive kerning stay transparent and boxes that overlap
+ * through negative kerning are blended twice. Boxes that abut with the same
+ * color are filled as one run, with SRC since they cover nothing yet. Parts
+ * are placed at their bar position less the origin of the buffer. */
+static void
+draw_part_background(pixman_image_t *image, Layout *layout, Part *part, uint32_t origin,
+		     pixman_color_t *bg_color, bool colored, uint32_t buf_height)
+{
+	int32_t x1 = (int32_t)part->x1 - (int32_t)origin;
+	int32_t x2 = (int32_t)part->x2 - (int32_t)origin;
+
+	if (!part->glyphs_l) {
+		fill_span(image, PIXMAN_OP_SRC, bg_color, x1, x2, buf_height);
+		return;
+	}
+
+	/* The run starts as the left padding, which ends where the first
+	 * glyph, never kerned, begins */
+	Glyph *glyphs = &layout->glyphs[part->glyphs];
+	pixman_color_t *run_color = bg_color;
+	int32_t run_x1 = x1, run_x2 = x1 + glyphs[0].x;
+	for (uint32_t i = 0; i <= part->glyphs_l; i++) {
+		pixman_color_t *color = bg_color;
+		int32_t bx1, bx2;
+		if (i < part->glyphs_l) {
+			bx1 = x1 + glyphs[i].x;
+			bx2 = x1 + glyphs[i].x2;
+			if (colored)
+				color = &glyphs[i].bg_color;
+		} else {
+			/* Right padding, from the last pen position */
+			bx1 = x1 + glyphs[i - 1].x2;
+			bx2 = x2;
+		}
+
+		if (bx1 == run_x2 && !memcmp(color, run_color, sizeof(*color))) {
+			run_x2 = MAX(run_x2, bx2);
+			continue;
+		}
+
+		fill_span(image, PIXMAN_OP_SRC, run_color, run_x1, run_x2, buf_height);
+		if (bx1 < run_x2) {
+			fill_span(image, PIXMAN_OP_OVER, color, bx1, MIN(bx2, run_x2), buf_height);
+			run_x1 = run_x2;
+		} else {
+			fill_span(image, PIXMAN_OP_SRC, &(pixman_color_t){ 0 }, run_x2, bx1, buf_height);
+			run_x1 = bx1;
+		}
+		run_x2 = MAX(run_x2, bx2);
+		run_color = color;
+	}
+	fill_span(image, PIXMAN_OP_SRC, run_color, run_x1, run_x2, buf_height);
+}
+
+static void
+draw_part_foreground(pixman_image_t *image, FillCache *cache, GlyphImages *images, Layout *layout,
+		     Part *part, uint32_t origin, pixman_color_t *fg_color, bool colored, uint32_t y)
+{
+	pixman_image_t *fg_fill = NULL;
+	pixman_color_t *fill_color = NULL;
+
+	for (uint32_t i = 0; i < part->glyphs_l; i++) {
+		Glyph *g = &layout->glyphs[part->glyphs + i];
+		const struct fcft_glyph *glyph = g->glyph;
+		pixman_color_t *color = colored ? &g->fg_color : fg_color;
+
+		if (!fill_color || memcmp(color, fill_color, sizeof(*color))) {
+			fg_fill = get_fill(cache, color, false);
+			fill_color = color;
+		}
+
+		int32_t x = (int32_t)part->x1 - (int32_t)origin + g->x;
+		pixman_image_t *pix = glyph_image(images, glyph->pix);
+		/* Detect and handle pre-rendered glyphs (e.g. emoji) */
+		if (pixman_image_get_format(pix) == PIXMAN_a8r8g8b8) {
+			/* Only the alpha channel of the mask is used, so we can
+			 * use fgfill here to blend prerendered glyphs with the
+			 * same opacity */
+			pixman_image_composite32(
+				PIXMAN_OP_OVER, pix, fg_fill, image, 0, 0, 0, 0,
+				x + glyph->x, y - glyph->y, glyph->width, glyph->height);
+		} else {
+			/* Applying the foreground color here would mess up
+			 * component alphas for subpixel-rendered text, so we
+			 * apply it when blending. */
+			pixman_image_composite32(
+				PIXMAN_OP_OVER, fg_fill, pix, image, 0, 0, 0, 0,
+				x + glyph->x, y - glyph->y, glyph->width, glyph->height);
+		}
+	}
+}
+
+/* Draws the clipped parts of a job's frame. Runs on a render worker, with
+ * its own fill cache and glyph images, or on the main thread with no glyph
+ * images. */
+static void
+render_job(RenderJob *job, FillCache *cache, GlyphImages *images)
+{
+	/* Everything is drawn straight into the buffer */
+	pixman_image_t *final = job->buffer->image;
+	Layout *layout = &job->surface->bar->text_layout;
+	struct fcft_font *font = layout->font;
+
+	uint32_t y = (job->height + font->ascent - font->descent) / 2;
+	uint32_t boxs = font->height / 9;
+	uint32_t boxw = font->height / 6 + 2;
+	uint64_t start = stats_enabled ? now_ns() : 0;
+
+	if (pixman_region32_not_empty(&job->clip)) {
+		pixman_image_set_clip_region32(final, &job->clip);
+
+		/* Backgrounds first, so that glyphs reaching into a
+		 * neighbouring part are not painted over */
+		for (int pass = 0; pass < 2; pass++) {
+			for (uint32_t i = 0; i < layout->parts_l; i++) {
+				Part *part = &layout->parts[i];
+				if (part->x2 <= job->x1 || part->x1 >= job->x2)
+					continue;
+				pixman_color_t *fg_color = &inactive_fg_color, *bg_color = &inactive_bg_color;
+				bool colored = false, occupied = false, filled = false;
+
+				if (part->type == PART_TAG) {
+					const bool active = job->mtags & 1 << part->index;
+					const bool urgent = job->urg & 1 << part->index;
+					fg_color = urgent ? &urgent_fg_color : (active ? &active_fg_color : &inactive_fg_color);
+					bg_color = urgent ? &urgent_bg_color : (active ? &active_bg_color : &inactive_bg_color);
+					occupied = !hide_vacant && job->ctags & 1 << part->index;
+					filled = job->sel && active;
+				} else if (part->type == PART_TITLE) {
+					fg_color = job->sel ? &title_fg_color : &inactive_fg_color;
+					bg_color = job->sel ? &title_bg_color : &inactive_bg_color;
+				} else if (part->type == PART_FILL) {
+					bg_color = job->sel ? &title_bg_color : &title_bg_color;
+				} else if (part->type == PART_STATUS || part->type == PART_MODULE
+					   || part->type == PART_BLOCK) {
+					colored = true;
+				}
+
+				if (pass == 0) {
+					draw_part_background(final, layout, part, job->origin, bg_color, colored, job->height);
+					continue;
+				}
+
+				if (occupied) {
+					/* Box in the corner of occupied tags, hollow
+					 * unless the tag is focused */
+					int32_t bx = (int32_t)part->x1 - (int32_t)job->origin + boxs;
+					bool hollow = !filled && boxw >= 3;
+					pixman_box32_t boxes[] = {
+						{ .x1 = bx, .x2 = bx + boxw, .y1 = boxs, .y2 = hollow ? boxs + 1 : boxs + boxw },
+						{ .x1 = bx, .x2 = bx + boxw, .y1 = boxs + boxw - 1, .y2 = boxs + boxw },
+						{ .x1 = bx, .x2 = bx + 1, .y1 = boxs + 1, .y2 = boxs + boxw - 1 },
+						{ .x1 = bx + boxw - 1, .x2 = bx + boxw, .y1 = boxs + 1, .y2 = boxs + boxw - 1 },
+					};
+					pixman_image_fill_boxes(PIXMAN_OP_OVER, final, fg_color, hollow ? 4 : 1, boxes);
+				}
+				draw_part_foreground(final, cache, images, layout, part, job->origin, fg_color, colored, y);
+			}
+		}
+
+		pixman_image_set_clip_region32(final, NULL);
+	}
+
+	if (stats_enabled) {
+		uint64_t ns = now_ns() - start;
+		int bucket = 0;
+		while (bucket < RENDER_BUCKETS - 1 && ns >= render_bucket_us[bucket] * 1000ull)
+			bucket++;
+		STAT_ADD(render_time[bucket], 1);
+		STAT_ADD(render_ns, ns);
+	}
+}
+
+/* Shows a drawn frame */
+static void
+commit_frame(Surface *surface)
+{
+	Bar *bar = surface->bar;
+	RenderJob *job = &surface->job;
+	Buffer *buffer = job->buffer;
+
+	pixman_region32_fini(&job->clip);
+	buffer->segments_l = job->segments_l;
+	surface->pool.last = buffer;
+	surface->rendering = false;
+	surface->uncommitted = false;
+	surface->mapped = true;
+
+	/* With a viewport the buffer is scaled to the surface size instead */
+	if (!surface->viewport)
+		wl_surface_set_buffer_scale(surface->wl_surface, bar->scale / 120);
+	wl_surface_attach(surface->wl_surface, buffer->wl_buffer, 0, 0);
+
+	/* Ask to be told when the compositor wants the next frame; a callback
+	 * that never arrived is replaced */
+	if (surface->frame_callback)
+		wl_callback_destroy(surface->frame_callback);
+	surface->frame_callback = wl_surface_frame(surface->wl_surface);
+	wl_callback_add_listener(surface->frame_callback, &frame_listener, surface);
+	surface->last_frame = now_ns();
+
+	wl_surface_commit(surface->wl_surface);
+
+	if (startup_trace) {
+		trace_startup("first frame committed");
+		startup_trace = false;
+	}
+}
+
+static void *
+render_worker(void *data)
+{
+	FillCache cache = {0};
+	GlyphImages images = {0};
+
+	pthread_mutex_lock(&render_lock);
+	for (;;) {
+		while (!render_quit && wl_list_empty(&render_queue))
+			pthread_cond_wait(&render_queued, &render_lock);
+		if (render_quit)
+			break;
+		RenderJob *job = wl_container_of(render_queue.prev, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&render_lock);
+
+		render_job(job, &cache, &images);
+
+		pthread_mutex_lock(&render_lock);
+		job->done = true;
+		wl_list_insert(&render_done, &job->link);
+		pthread_cond_broadcast(&render_finished);
+		uint64_t one = 1;
+		if (write(render_efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			EDIE("write");
+	}
+	pthread_mutex_unlock(&render_lock);
+
+	fill_cache_finish(&cache);
+	glyph_images_finish(&images);
+	return NULL;
+}
+
+/* Commits the frames that render workers have finished */
+static void
+render_done_handler(EventSource *source, uint32_t events)
+{
+	uint64_t count;
+	if (read(source->fd, &count, sizeof(count)) == -1)
+		return;
+
+	struct wl_list done;
+	wl_list_init(&done);
+	pthread_mutex_lock(&render_lock);
+	wl_list_insert_list(&done, &render_done);
+	wl_list_init(&render_done);
+	pthread_mutex_unlock(&render_lock);
+
+	RenderJob *job, *job2;
+	wl_list_for_each_safe(job, job2, &done, link) {
+		wl_list_remove(&job->link);
+		commit_frame(job->surface);
+	}
+}
+
+/* Waits for the bar's pending frames, if any, and drops them, so that their
+ * buffers and the layout can be changed. The bar is drawn again later. */
+static void
+wait_render(Bar *bar)
+{
+	for (uint32_t i = 0; i < bar->surfaces_l; i++) {
+		Surface *surface = &bar->surfaces[i];
+		if (!surface->rendering)
+			continue;
+
+		pthread_mutex_lock(&render_lock);
+		while (!surface->job.done)
+			pthread_cond_wait(&render_finished, &render_lock);
+		wl_list_remove(&surface->job.link);
+		pthread_mutex_unlock(&render_lock);
+
+		pixman_region32_fini(&surface->job.clip);
+		surface->job.buffer->busy = false;
+		surface->rendering = false;
+		bar->redraw = true;
+	}
+}
+
+/* Returns the buffer length of a surface length at a scale in 120ths */
+static uint32_t
+scale_length(uint32_t length, uint32_t scale)
+{
+	return (length * scale + 60) / 120;
+}
+
+/* Places a subsurface over the range of the bar between x1 and x2, whose
+ * logical positions are lx1 and lx2. An empty range unmaps it. */
+static void
+place_subsurface(Surface *surface, uint32_t x1, uint32_t x2, uint32_t lx1, uint32_t lx2)
+{
+	Bar *bar = surface->bar;
+
+	surface->x1 = surface->origin = x1;
+	surface->x2 = x2;
+	if (x1 >= x2) {
+		if (surface->mapped) {
+			wl_surface_attach(surface->wl_surface, NULL, 0, 0);
+			wl_surface_commit(surface->wl_surface);
+			surface->pool.last = NULL;
+			surface->mapped = false;
+		}
+		return;
+	}
+
+	if (surface->pool.width != x2 - x1 || surface->pool.height != bar->height)
+		if (pool_resize(&surface->pool, x2 - x1, bar->height) == -1)
+			EDIE("pool_resize");
+	if (surface->viewport && surface->surface_width != lx2 - lx1)
+		wp_viewport_set_destination(surface->viewport, lx2 - lx1, bar->surface_height);
+	surface->surface_width = lx2 - lx1;
+
+	/* The new position only takes effect once the main surface commits */
+	if (surface->surface_x != lx1) {
+		wl_subsurface_set_position(surface->wl_subsurface, lx1, 0);
+		surface->surface_x = lx1;
+		bar->surfaces[SURFACE_MAIN].uncommitted = true;
+	}
+}
+
+/* Lays out the bar if needed, splits it between its surfaces and records
+ * each surface's parts as segments, in buffer coordinates, so that only the
+ * ones that changed are redrawn and damaged */
+static void
+update_surfaces(Bar *bar)
+{
+	Layout *layout = &bar->text_layout;
+	if (bar->relayout || layout->width != bar->width || layout->visible_tags != visible_tags(bar)
+	    || layout->show_layout != (bool)(bar->mtags & bar->ctags))
+		update_layout(bar);
+
+	Surface *main_surface = &bar->surfaces[SURFACE_MAIN];
+	main_surface->x1 = main_surface->origin = 0;
+	main_surface->x2 = bar->width;
+	if (bar->surfaces_l > 1) {
+		/* Tags and modes go up to the layout symbol, the status and
+		 * blocks from the status on. Both edges are moved outwards to
+		 * a logical pixel, which the subsurfaces are positioned in. */
+		uint32_t tags_x = 0, status_x = bar->width;
+		for (uint32_t i = 0; i < layout->parts_l; i++) {
+			Part *part = &layout->parts[i];
+			if (part->type == PART_TAG || part->type == PART_MODE || part->type == PART_LAYOUT)
+				tags_x = part->x2;
+			else if ((part->type == PART_STATUS || part->type == PART_MODULE
+				  || part->type == PART_BLOCK) && status_x == bar->width)
+				status_x = part->x1;
+		}
+		uint32_t tags_lx = MIN((tags_x * 120 + bar->scale - 1) / bar->scale, bar->surface_width);
+		uint32_t status_lx = MAX(status_x * 120 / bar->scale, tags_lx);
+		tags_x = scale_length(tags_lx, bar->scale);
+		status_x = scale_length(status_lx, bar->scale);
+
+		place_subsurface(&bar->surfaces[SURFACE_TAGS], 0, tags_x, 0, tags_lx);
+		place_subsurface(&bar->surfaces[SURFACE_STATUS], status_x, bar->width,
+				 status_lx, bar->surface_width);
+		main_surface->x1 = tags_x;
+		main_surface->x2 = status_x;
+	}
+
+	for (uint32_t i = 0; i < bar->surfaces_l; i++) {
+		Surface *surface = &bar->surfaces[i];
+		if (layout->parts_l > surface->segments_cap) {
+			surface->segments_cap = layout->parts_l;
+			if (!(surface->segments = realloc(surface->segments, surface->segments_cap * sizeof(Segment))))
+				EDIE("realloc");
+		}
+
+		surface->segments_l = 0;
+		for (uint32_t j = 0; j < layout->parts_l; j++) {
+			Part *part = &layout->parts[j];
+			uint32_t x1 = MAX(part->x1, surface->x1), x2 = MIN(part->x2, surface->x2);
+			if (x1 >= x2)
+				continue;
+
+			uint64_t hash = part->hash;
+			if (part->type == PART_TAG) {
+				uint32_t tag = 1 << part->index;
+				hash = hash_bytes(hash, &(bool[]){
+						bar->mtags & tag, bar->ctags & tag, bar->urg & tag, bar->sel
+					}, 4 * sizeof(bool));
+			} else if (part->type == PART_TITLE) {
+				hash = hash_bytes(hash, &bar->sel, sizeof(bar->sel));
+			}
+			/* Bars at different scales may share a buffer height but
+			 * not a font, and a part cut off by the edge of a buffer
+			 * depends on where it starts */
+			int32_t offset = (int32_t)part->x1 - (int32_t)surface->origin;
+			hash = hash_bytes(hash, &bar->font, sizeof(bar->font));
+			hash = hash_bytes(hash, &offset, sizeof(offset));
+			surface->segments[surface->segments_l++] = (Segment){
+				.x1 = x1 - surface->origin, .x2 = x2 - surface->origin, .hash = hash
+			};
+		}
+	}
+}
+
+/* Returns whether the surface shows something other than its segments */
+static bool
+surface_dirty(Surface *surface)
+{
+	Buffer *last = surface->pool.last;
+	if (surface->wl_subsurface && surface->x1 >= surface->x2)
+		return false;
+	return surface->uncommitted || !surface->mapped || !last || last->segments_l != surface->segments_l
+		|| memcmp(last->segments, surface->segments, surface->segments_l * sizeof(Segment));
+}
+
+/* Works out which parts of a buffer need drawing for the surface's
+ * segments. With parallel set, the drawing is left to a render worker and
+ * the frame is committed once it is done; otherwise it happens right
+ * away. */
+/* Sets up the surface's job, which draws the segments missing from the
+ * buffer. Until the job is done the buffer holds no segment that others
+ * could copy. */
+static RenderJob *
+prepare_job(Surface *surface, Buffer *buffer)
+{
+	Bar *bar = surface->bar;
+	Segment *segments = surface->segments;
+	uint32_t segments_l = surface->segments_l;
+
+	pixman_region32_t clip;
+	pixman_region32_init(&clip);
+	for (uint32_t i = 0; i < segments_l; i++) {
+		Segment *segment = &segments[i];
+		if (!segment_drawn(buffer->segments, buffer->segments_l, segment)
+		    && !(share_segments && copy_segment(buffer, surface->pool.height, segment)))
+			pixman_region32_union_rect(&clip, &clip, segment->x1, 0,
+						   segment->x2 - segment->x1, bar->height);
+	}
+
+	/* Remember what the buffer holds once drawn */
+	if (MAX(segments_l, 1) > buffer->segments_cap) {
+		buffer->segments_cap = MAX(segments_l, 1);
+		if (!(buffer->segments = realloc(buffer->segments, buffer->segments_cap * sizeof(Segment))))
+			EDIE("realloc");
+	}
+	memcpy(buffer->segments, segments, segments_l * sizeof(Segment));
+	buffer->segments_l = 0;
+	buffer->busy = true;
+
+	RenderJob *job = &surface->job;
+	*job = (RenderJob){
+		.surface = surface, .buffer = buffer, .segments_l = segments_l, .clip = clip,
+		.x1 = surface->x1, .x2 = surface->x2, .origin = surface->origin,
+		.mtags = bar->mtags, .ctags = bar->ctags, .urg = bar->urg,
+		.height = bar->height, .sel = bar->sel,
+	};
+	surface->rendering = true;
+	return job;
+}
+
+static int
+draw_frame(Surface *surface, bool parallel)
+{
+	Bar *bar = surface->bar;
+
+	/* Wait for the compositor to release a buffer rather than allocating
+	 * another one */
+	Buffer *buffer = pool_get_buffer(&surface->pool);
+	if (!buffer)
+		return -1;
+
+	/* Damage the segments that differ from the frame the compositor
+	 * currently shows, merging neighbouring ones */
+	Segment *segments = surface->segments;
+	uint32_t segments_l = surface->segments_l;
+	Buffer *last = surface->mapped ? surface->pool.last : NULL;
+	uint32_t damage_x1 = 0;
+	bool damage = false;
+	for (uint32_t i = 0; i <= segments_l; i++) {
+		Segment *segment = i < segments_l ? &segments[i] : NULL;
+		bool changed = segment && (!last || !segment_drawn(last->segments, last->segments_l, segment));
+		if (changed && !damage) {
+			damage_x1 = segment->x1;
+			damage = true;
+		} else if (!changed && damage) {
+			uint32_t x2 = segment ? segment->x1 : segments[segments_l - 1].x2;
+			wl_surface_damage_buffer(surface->wl_surface, damage_x1, 0, x2 - damage_x1, bar->height);
+			damage = false;
+		}
+	}
 
-	wl_surface_set_buffer_scale(bar->wl_surface, buffer_scale);
-	wl_surface_attach(bar->wl_surface, buffer, 0, 0);
-	wl_surface_damage_buffer(bar->wl_surface, 0, 0, bar->width, bar->height);
-	wl_surface_commit(bar->wl_surface);
+	RenderJob *job = prepare_job(surface, buffer);
+	if (parallel && pixman_region32_not_empty(&job->clip)) {
+		pthread_mutex_lock(&render_lock);
+		wl_list_insert(&render_queue, &job->link);
+		pthread_cond_signal(&render_queued);
+		pthread_mutex_unlock(&render_lock);
+		return 0;
+	}
 
+	render_job(job, &fill_cache, NULL);
+	commit_frame(surface);
 	return 0;
 }
 
+/* Sizes the main surface's buffers for its surface size and scale. Those
+ * of subsurfaces follow the layout. */
+static void
+resize_bar(Bar *bar)
+{
+	Surface *surface = &bar->surfaces[SURFACE_MAIN];
+
+	bar->width = scale_length(bar->surface_width, bar->scale);
+	bar->height = scale_length(bar->surface_height, bar->scale);
+
+	/* Buffers are only rebuilt when the size changes */
+	if (bar->width != surface->pool.width || bar->height != surface->pool.height)
+		if (pool_resize(&surface->pool, bar->width, bar->height) == -1)
+			EDIE("pool_resize");
+	if (surface->viewport)
+		wp_viewport_set_destination(surface->viewport, bar->surface_width, bar->surface_height);
+	bar->redraw = true;
+}
+
 /* Layer-surface setup adapted from layer-shell example in [wlroots] */
 static void
 layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
@@ -477,20 +1873,15 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 	zwlr_layer_surface_v1_ack_configure(surface, serial);
 	
 	Bar *bar = (Bar *)data;
-	
-	w *= buffer_scale;
-	h *= buffer_scale;
 
-	if (bar->configured && w == bar->width && h == bar->height)
+	if (bar->configured && w == bar->surface_width && h == bar->surface_height)
 		return;
 	
-	bar->width = w;
-	bar->height = h;
-	bar->stride = bar->width * 4;
-	bar->bufsize = bar->stride * bar->height;
+	wait_render(bar);
+	bar->surface_width = w;
+	bar->surface_height = h;
 	bar->configured = true;
-
-	draw_frame(bar);
+	resize_bar(bar);
 }
 
 static void
@@ -504,6 +1895,260 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 	.closed = layer_surface_closed,
 };
 
+/* Starts a thread with all signals blocked, leaving them to the signalfd */
+static int
+start_thread(pthread_t *thread, void *(*func)(void *), void *data)
+{
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	int err = pthread_create(thread, NULL, func, data);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	return err;
+}
+
+/* Rasterizes the tag names, printable ASCII and the -prewarm codepoints
+ * into fcft's glyph cache, so that the first frame does not pay for them.
+ * fcft locks the font, so this runs alongside the main thread. */
+static void *
+prewarm(void *data)
+{
+	struct fcft_font *font = data;
+
+	for (uint32_t i = 0; i < tags_l && !atomic_load_explicit(&prewarm_stop, memory_order_relaxed); i++) {
+		uint32_t codepoint, state = UTF8_ACCEPT;
+		for (char *p = tags[i]; *p; p++)
+			if (!utf8decode(&state, &codepoint, *p))
+				fcft_rasterize_char_utf32(font, codepoint, FCFT_SUBPIXEL_NONE);
+	}
+	for (uint32_t cp = 0x20; cp < 0x7f && !atomic_load_explicit(&prewarm_stop, memory_order_relaxed); cp++)
+		fcft_rasterize_char_utf32(font, cp, FCFT_SUBPIXEL_NONE);
+	for (size_t i = 0; i < prewarm_codepoints_l
+		     && !atomic_load_explicit(&prewarm_stop, memory_order_relaxed); i++)
+		fcft_rasterize_char_utf32(font, prewarm_codepoints[i], FCFT_SUBPIXEL_NONE);
+
+	return NULL;
+}
+
+/* Loads the font at the DPI matching a scale in 120ths */
+static struct fcft_font *
+load_font_at(uint32_t scale)
+{
+	char buf[32];
+	snprintf(buf, sizeof buf, "dpi=%g", 96.0 * scale / 120);
+	return fcft_from_name(1, (const char *[]) {fontstr}, buf);
+}
+
+/* Destroys a font no bar uses, and with it its glyphs, which render workers
+ * may still have images of */
+static void
+destroy_font(struct fcft_font *font)
+{
+	atomic_fetch_add_explicit(&font_generation, 1, memory_order_relaxed);
+	fcft_destroy(font);
+}
+
+/* Returns a reference to the cached font for a scale in 120ths, if any */
+static struct fcft_font *
+find_font(uint32_t scale)
+{
+	for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+		if (font_cache[i].font && font_cache[i].scale == scale) {
+			font_cache[i].refs++;
+			return font_cache[i].font;
+		}
+	}
+	return NULL;
+}
+
+/* Caches a newly loaded font without taking a reference, evicting an unused
+ * one if need be. With every slot in use it returns false; the font is then
+ * for one bar only, and put_font() destroys it. */
+static bool
+cache_font(uint32_t scale, struct fcft_font *scaled)
+{
+	int victim = -1;
+	for (int i = 0; i < FONT_CACHE_SIZE; i++)
+		if (!font_cache[i].refs && (victim == -1 || !font_cache[i].font))
+			victim = i;
+	if (victim == -1)
+		return false;
+	if (font_cache[victim].font)
+		destroy_font(font_cache[victim].font);
+	font_cache[victim].scale = scale;
+	font_cache[victim].refs = 0;
+	font_cache[victim].font = scaled;
+	return true;
+}
+
+static void
+put_font(struct fcft_font *font)
+{
+	for (int i = 0; i < FONT_CACHE_SIZE; i++) {
+		if (font_cache[i].font == font) {
+			font_cache[i].refs--;
+			return;
+		}
+	}
+	destroy_font(font);
+}
+
+static void
+font_cache_finish(void)
+{
+	for (int i = 0; i < FONT_CACHE_SIZE; i++)
+		if (font_cache[i].font)
+			destroy_font(font_cache[i].font);
+	memset(font_cache, 0, sizeof(font_cache));
+}
+
+/* Switches the bar to a scale in 120ths and a font loaded for it, taking
+ * over the caller's reference */
+static void
+use_font(Bar *bar, struct fcft_font *scaled, uint32_t scale)
+{
+	wait_render(bar);
+	if (bar->font)
+		put_font(bar->font);
+	bar->font = scaled;
+	bar->scale = scale;
+	bar->textpadding = bar->font->height / 2;
+
+	/* Measurements and segments drawn with the old font are stale */
+	invalidate_measures(bar);
+	bar->relayout = true;
+	for (uint32_t i = 0; i < bar->surfaces_l; i++)
+		pool_finish(&bar->surfaces[i].pool);
+	if (bar->configured)
+		resize_bar(bar);
+}
+
+/* Loads the font for a scale and rasterizes the prewarm set with it, away
+ * from the main thread, where fontconfig matching would hold up frames */
+static void *
+font_load(void *data)
+{
+	FontLoad *load = data;
+	if ((load->font = load_font_at(load->scale)))
+		prewarm(load->font);
+
+	uint64_t one = 1;
+	atomic_store_explicit(&load->done, true, memory_order_release);
+	if (write(font_efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("write");
+	return NULL;
+}
+
+/* Starts loading the font for a scale unless that is already under way */
+static bool
+request_font(uint32_t scale)
+{
+	FontLoad *load;
+	wl_list_for_each(load, &font_loads, link)
+		if (load->scale == scale)
+			return true;
+
+	if (!(load = calloc(1, sizeof(FontLoad))))
+		EDIE("calloc");
+	load->scale = scale;
+	int err;
+	if ((err = start_thread(&load->thread, font_load, load))) {
+		fprintf(stderr, "Could not start font thread: %s\n", strerror(err));
+		free(load);
+		return false;
+	}
+	wl_list_insert(&font_loads, &load->link);
+	return true;
+}
+
+/* Switches the bar to a scale in 120ths, with a font to match. A font that
+ * is not cached is loaded in the background; until then the bar keeps its
+ * font and scale, or takes the startup font if it has none. */
+static void
+set_bar_scale(Bar *bar, uint32_t scale)
+{
+	bar->pending_scale = 0;
+	if (scale == bar->scale)
+		return;
+
+	struct fcft_font *scaled = find_font(scale);
+	if (scaled) {
+		use_font(bar, scaled, scale);
+		return;
+	}
+	if (!bar->font)
+		use_font(bar, find_font(buffer_scale * 120), buffer_scale * 120);
+	if (request_font(scale))
+		bar->pending_scale = scale;
+}
+
+/* Hands finished fonts to the bars waiting for them */
+static void
+font_load_handler(EventSource *source, uint32_t events)
+{
+	uint64_t count;
+	if (read(font_efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		EDIE("read");
+
+	FontLoad *load, *tmp;
+	wl_list_for_each_safe(load, tmp, &font_loads, link) {
+		if (!atomic_load_explicit(&load->done, memory_order_acquire))
+			continue;
+		pthread_join(load->thread, NULL);
+		wl_list_remove(&load->link);
+		if (!load->font)
+			fprintf(stderr, "Could not load font at scale %g\n", load->scale / 120.0);
+		bool cached = load->font && cache_font(load->scale, load->font);
+		bool taken = false;
+
+		Bar *bar;
+		wl_list_for_each(bar, &bar_list, link) {
+			if (bar->pending_scale != load->scale)
+				continue;
+			bar->pending_scale = 0;
+			if (!load->font)
+				continue;
+			if (cached) {
+				use_font(bar, find_font(load->scale), load->scale);
+			} else if (!taken) {
+				use_font(bar, load->font, load->scale);
+				taken = true;
+			} else {
+				/* An uncached font is not shared */
+				set_bar_scale(bar, load->scale);
+			}
+		}
+		if (load->font && !cached && !taken)
+			destroy_font(load->font);
+		free(load);
+	}
+}
+
+/* Waits for fonts still loading at exit and destroys them */
+static void
+font_loads_finish(void)
+{
+	FontLoad *load, *tmp;
+	wl_list_for_each_safe(load, tmp, &font_loads, link) {
+		pthread_join(load->thread, NULL);
+		if (load->font)
+			destroy_font(load->font);
+		wl_list_remove(&load->link);
+		free(load);
+	}
+}
+
+static void
+fractional_scale_preferred_scale(void *data, struct wp_fractional_scale_v1 *fractional_scale,
+				 uint32_t scale)
+{
+	set_bar_scale((Bar *)data, scale);
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
+};
+
 static void
 pointer_enter(void *data, struct wl_pointer *pointer,
 	      uint32_t serial, struct wl_surface *surface,
@@ -512,6 +2157,14 @@ pointer_enter(void *data, struct wl_pointer *pointer,
 	Seat *seat = (Seat *)data;
 
 	seat->hovering = true;
+
+	/* Subsurfaces report positions relative to themselves */
+	seat->pointer_offset = 0;
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link)
+		for (uint32_t i = 0; i < bar->surfaces_l; i++)
+			if (bar->surfaces[i].wl_surface == surface)
+				seat->pointer_offset = bar->surfaces[i].surface_x;
 	
 	if (!cursor_image) {
 		struct wl_cursor_theme *cursor_theme = wl_cursor_theme_load(NULL, 24 * buffer_scale, shm);
@@ -550,7 +2203,7 @@ pointer_motion(void *data, struct wl_pointer *pointer, uint32_t time,
 {
 	Seat *seat = (Seat *)data;
 
-	seat->pointer_x = wl_fixed_to_int(surface_x);
+	seat->pointer_x = wl_fixed_to_int(surface_x) + seat->pointer_offset;
 	seat->pointer_y = wl_fixed_to_int(surface_y);
 }
 
@@ -564,19 +2217,13 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 
 	uint32_t button = seat->pointer_button;
 	seat->pointer_button = 0;
-	
-	uint32_t i = 0, x = 0;
-	do {
-		if (hide_vacant) {
-			const bool active = seat->bar->mtags & 1 << i;
-			const bool occupied = seat->bar->ctags & 1 << i;
-			const bool urgent = seat->bar->urg & 1 << i;
-			if (!active && !occupied && !urgent)
-				continue;
-		}
-		x += TEXT_WIDTH(tags[i], seat->bar->width - x, seat->bar->textpadding, false) / buffer_scale;
-	} while (seat->pointer_x >= x && ++i < tags_l);
-	if (i < tags_l) {
+
+	/* Hit-test against the layout that was last drawn */
+	Part *part = layout_part_at(&seat->bar->text_layout, scale_length(seat->pointer_x, seat->bar->scale));
+	if (!part)
+		return;
+
+	if (part->type == PART_TAG) {
 		/* Clicked on tags */
 		char *cmd;
 		if (button == BTN_LEFT)
@@ -590,16 +2237,18 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 
 		zriver_control_v1_add_argument(river_control, cmd);
 		char buf[32];
-		snprintf(buf, sizeof(buf), "%d", 1 << i);
+		snprintf(buf, sizeof(buf), "%d", 1 << part->index);
 		zriver_control_v1_add_argument(river_control, buf);
 		zriver_control_v1_run_command(river_control, seat->wl_seat);
 		return;
 	}
-	
-	Seat *it;
-	wl_list_for_each(it, &seat_list, link) {
-		x += TEXT_WIDTH(it->mode, seat->bar->width - x, seat->bar->textpadding, false) / buffer_scale;
-		if (seat->pointer_x < x) {
+
+	if (part->type == PART_MODE) {
+		Seat *it;
+		uint32_t i = 0;
+		wl_list_for_each(it, &seat_list, link) {
+			if (i++ != part->index)
+				continue;
 			/* clicked on mode */
 			char *mode;
 			if (button == BTN_LEFT)
@@ -616,20 +2265,6 @@ pointer_frame(void *data, struct wl_pointer *pointer)
 	}
 
 	// TODO: run custom commands upon clicking layout, title, status
-	if (seat->bar->mtags & seat->bar->ctags) {
-		x += TEXT_WIDTH(seat->bar->layout, seat->bar->width - x, seat->bar->textpadding, false) / buffer_scale;
-		if (seat->pointer_x < x) {
-			/* clicked on layout */
-			return;
-		}
-	}
-	
-	if (seat->pointer_x < seat->bar->width / buffer_scale - TEXT_WIDTH(seat->bar->status, seat->bar->width - x, seat->bar->textpadding, true) / buffer_scale) {
-		/* clicked on title */
-		return;
-	}
-	
-	/* clicked on status */
 }
 
 static void
@@ -699,9 +2334,24 @@ output_mode(void *data, struct wl_output *wl_output,
 	uint32_t flags, int32_t width, int32_t height,
 	int32_t refresh)
 {
+	Bar *bar = (Bar *)data;
+
+	if (flags & WL_OUTPUT_MODE_CURRENT && refresh > 0)
+		bar->refresh = refresh;
 }
 
-static void
+/* Returns the id bound to an output name, or -1 */
+static int32_t
+find_binding(const char *name)
+{
+	Binding *binding;
+	wl_list_for_each(binding, &binding_list, link)
+		if (!strcmp(binding->name, name))
+			return binding->id;
+	return -1;
+}
+
+static void
 output_name(void *data, struct wl_output *wl_output,
 	const char *name)
 {
@@ -711,12 +2361,20 @@ output_name(void *data, struct wl_output *wl_output,
 		free(bar->output_name);
 	if (!(bar->output_name = strdup(name)))
 		EDIE("strdup");
+	bar->bind_id = find_binding(name);
 }
 
 static void
 output_scale(void *data, struct wl_output *wl_output,
 	int32_t factor)
 {
+	Bar *bar = (Bar *)data;
+
+	/* A preferred fractional scale takes precedence. Bars are given
+	 * their scale once the font can be loaded. */
+	bar->output_scale = factor;
+	if (bar->font && !bar->fractional_scale)
+		set_bar_scale(bar, factor * 120);
 }
 
 static const struct wl_output_listener output_listener = {
@@ -798,6 +2456,7 @@ river_output_status_layout_name(void *data, struct zriver_output_status_v1 *outp
 		free(bar->layout);
 	if (!(bar->layout = strdup(name)))
 		EDIE("strdup");
+	bar->relayout = true;
 	bar->redraw = true;
 }
 
@@ -809,6 +2468,8 @@ river_output_status_layout_name_clear(void *data, struct zriver_output_status_v1
 	if (bar->layout) {
 		free(bar->layout);
 		bar->layout = NULL;
+		bar->relayout = true;
+		bar->redraw = true;
 	}
 }
 
@@ -866,6 +2527,7 @@ river_seat_status_focused_view(void *data, struct zriver_seat_status_v1 *seat_st
 		free(seat->bar->title);
 	if (!(seat->bar->title = strdup(title)))
 		EDIE("strdup");
+	seat->bar->relayout = true;
 	seat->bar->redraw = true;
 }
 
@@ -881,8 +2543,10 @@ river_seat_status_mode(void *data, struct zriver_seat_status_v1 *seat_status,
 		EDIE("strdup");
 	
 	Bar *bar;
-	wl_list_for_each(bar, &bar_list, link)
+	wl_list_for_each(bar, &bar_list, link) {
+		bar->relayout = true;
 		bar->redraw = true;
+	}
 }
 
 static const struct zriver_seat_status_v1_listener river_seat_status_listener = {
@@ -893,34 +2557,111 @@ static const struct zriver_seat_status_v1_listener river_seat_status_listener =
 };
 
 static void
-show_bar(Bar *bar)
+init_surface(Bar *bar, Surface *surface)
 {
-	bar->wl_surface = wl_compositor_create_surface(compositor);
-	if (!bar->wl_surface)
+	surface->bar = bar;
+	if (!(surface->wl_surface = wl_compositor_create_surface(compositor)))
 		DIE("Could not create wl_surface");
+	if (fractional_scale_manager && viewporter)
+		surface->viewport = wp_viewporter_get_viewport(viewporter, surface->wl_surface);
+}
 
-	bar->layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, bar->wl_surface, bar->wl_output,
+static void
+create_surfaces(Bar *bar)
+{
+	Surface *main_surface = &bar->surfaces[SURFACE_MAIN];
+	init_surface(bar, main_surface);
+	bar->surfaces_l = 1;
+
+	bar->layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, main_surface->wl_surface, bar->wl_output,
 								   ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM, PROGRAM);
 	if (!bar->layer_surface)
 		DIE("Could not create layer_surface");
 	zwlr_layer_surface_v1_add_listener(bar->layer_surface, &layer_surface_listener, bar);
 
-	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, bar->height / buffer_scale);
+	/* Render at the compositor's preferred scale where it can tell us;
+	 * -scale remains the fallback */
+	if (main_surface->viewport) {
+		bar->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+			fractional_scale_manager, main_surface->wl_surface);
+		wp_fractional_scale_v1_add_listener(bar->fractional_scale, &fractional_scale_listener, bar);
+	}
+
+	/* Desynchronized subsurfaces commit on their own, without the main
+	 * surface */
+	if (subsurfaces && subcompositor) {
+		for (; bar->surfaces_l < SURFACES; bar->surfaces_l++) {
+			Surface *surface = &bar->surfaces[bar->surfaces_l];
+			init_surface(bar, surface);
+			surface->wl_subsurface = wl_subcompositor_get_subsurface(subcompositor, surface->wl_surface,
+										 main_surface->wl_surface);
+			if (!surface->wl_subsurface)
+				DIE("Could not create wl_subsurface");
+			wl_subsurface_set_desync(surface->wl_subsurface);
+		}
+	}
+}
+
+/* Maps the bar. A bar hidden before keeps its surfaces, which only need a
+ * commit without a buffer and the configure that answers it; the frame
+ * drawn before hiding is then attached again without redrawing. */
+static void
+show_bar(Bar *bar)
+{
+	if (!bar->surfaces_l)
+		create_surfaces(bar);
+	Surface *main_surface = &bar->surfaces[SURFACE_MAIN];
+
+	zwlr_layer_surface_v1_set_size(bar->layer_surface, 0, height);
 	zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
 					 (bar->bottom ? ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM : ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP)
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
 					 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, bar->height / buffer_scale);
-	wl_surface_commit(bar->wl_surface);
+	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, height);
+	wl_surface_commit(main_surface->wl_surface);
 
+	bar->configured = false;
 	bar->hidden = false;
 }
 
+/* Destroys the bar's surfaces along with their buffers and callbacks,
+ * which may never be released once the surfaces are gone */
+static void
+destroy_surfaces(Bar *bar)
+{
+	while (bar->surfaces_l > 0) {
+		Surface *surface = &bar->surfaces[--bar->surfaces_l];
+		if (surface->viewport)
+			wp_viewport_destroy(surface->viewport);
+		if (surface->wl_subsurface)
+			wl_subsurface_destroy(surface->wl_subsurface);
+		if (surface == &bar->surfaces[SURFACE_MAIN]) {
+			if (bar->fractional_scale)
+				wp_fractional_scale_v1_destroy(bar->fractional_scale);
+			bar->fractional_scale = NULL;
+			zwlr_layer_surface_v1_destroy(bar->layer_surface);
+		}
+		wl_surface_destroy(surface->wl_surface);
+		pool_finish(&surface->pool);
+		if (surface->frame_callback)
+			wl_callback_destroy(surface->frame_callback);
+		free(surface->segments);
+		memset(surface, 0, sizeof(*surface));
+	}
+}
+
+/* Unmaps the bar, keeping its surfaces, buffers and layout. Subsurfaces
+ * are unmapped along with the main surface. */
 static void
 hide_bar(Bar *bar)
 {
-	zwlr_layer_surface_v1_destroy(bar->layer_surface);
-	wl_surface_destroy(bar->wl_surface);
+	Surface *main_surface = &bar->surfaces[SURFACE_MAIN];
+
+	wait_render(bar);
+	zwlr_layer_surface_v1_set_exclusive_zone(bar->layer_surface, 0);
+	wl_surface_attach(main_surface->wl_surface, NULL, 0, 0);
+	wl_surface_commit(main_surface->wl_surface);
+	main_surface->mapped = false;
 
 	bar->configured = false;
 	bar->hidden = true;
@@ -929,8 +2670,8 @@ hide_bar(Bar *bar)
 static void
 setup_bar(Bar *bar)
 {
-	bar->height = height * buffer_scale;
-	bar->textpadding = textpadding;
+	set_bar_scale(bar, bar->output_scale * 120);
+	bar->height = height * bar->scale / 120;
 	bar->bottom = bottom;
 	bar->hidden = hidden;
 
@@ -956,6 +2697,8 @@ handle_global(void *data, struct wl_registry *registry,
 {
 	if (!strcmp(interface, wl_compositor_interface.name)) {
 		compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+	} else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+		subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
 	} else if (!strcmp(interface, wl_shm_interface.name)) {
 		shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (!strcmp(interface, zwlr_layer_shell_v1_interface.name)) {
@@ -964,11 +2707,18 @@ handle_global(void *data, struct wl_registry *registry,
 		river_status_manager = wl_registry_bind(registry, name, &zriver_status_manager_v1_interface, 4);
 	} else if (!strcmp(interface, zriver_control_v1_interface.name)) {
 		river_control = wl_registry_bind(registry, name, &zriver_control_v1_interface, 1);
+	} else if (!strcmp(interface, wp_viewporter_interface.name)) {
+		viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+	} else if (!strcmp(interface, wp_fractional_scale_manager_v1_interface.name)) {
+		fractional_scale_manager = wl_registry_bind(registry, name, &wp_fractional_scale_manager_v1_interface, 1);
 	} else if (!strcmp(interface, wl_output_interface.name)) {
 		Bar *bar = calloc(1, sizeof(Bar));
 		if (!bar)
 			EDIE("calloc");
 		bar->registry_name = name;
+		wl_list_init(&bar->block_list);
+		bar->bind_id = -1;
+		bar->output_scale = buffer_scale;
 		bar->wl_output = wl_registry_bind(registry, name, &wl_output_interface, 4);
 		wl_output_add_listener(bar->wl_output, &output_listener, bar);
 		if (run_display)
@@ -988,252 +2738,1315 @@ handle_global(void *data, struct wl_registry *registry,
 }
 
 static void
-teardown_bar(Bar *bar)
+destroy_block(Block *block)
+{
+	wl_list_remove(&block->link);
+	free(block->name);
+	free(block->status);
+	free_measure(&block->measure);
+	free(block);
+}
+
+static void
+teardown_bar(Bar *bar)
+{
+	wait_render(bar);
+	if (bar->title)
+		free(bar->title);
+	if (bar->layout)
+		free(bar->layout);
+	free(bar->status);
+	Block *block, *block2;
+	wl_list_for_each_safe(block, block2, &bar->block_list, link)
+		destroy_block(block);
+	if (bar->output_name)
+		free(bar->output_name);
+	free(bar->text_layout.parts);
+	free(bar->text_layout.glyphs);
+	free_measures(bar);
+	zriver_output_status_v1_destroy(bar->river_output_status);
+	destroy_surfaces(bar);
+	if (bar->font)
+		put_font(bar->font);
+	wl_output_destroy(bar->wl_output);
+	free(bar);
+}
+
+static void
+teardown_seat(Seat *seat)
+{
+	if (seat->mode)
+		free(seat->mode);
+	zriver_seat_status_v1_destroy(seat->river_seat_status);
+	if (seat->wl_pointer)
+		wl_pointer_destroy(seat->wl_pointer);
+	wl_seat_destroy(seat->wl_seat);
+	free(seat);
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+	Bar *bar;
+	Seat *seat;
+	
+	wl_list_for_each(bar, &bar_list, link) {
+		if (bar->registry_name == name) {
+			wl_list_remove(&bar->link);
+			teardown_bar(bar);
+			return;
+		}
+	}
+	wl_list_for_each(seat, &seat_list, link) {
+		if (seat->registry_name == name) {
+			wl_list_remove(&seat->link);
+			teardown_seat(seat);
+			/* Modes are laid out by their position in the seat list */
+			wl_list_for_each(bar, &bar_list, link) {
+				bar->relayout = true;
+				bar->redraw = true;
+			}
+			return;
+		}
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = handle_global,
+	.global_remove = handle_global_remove
+};
+
+static void
+set_status(Bar *bar, char *data, size_t len)
+{
+	/* Repeating what is already shown does not dirty the bar */
+	if (bar->status && bar->status->hash == hash_bytes(HASH_INIT, data, len)) {
+		STAT_ADD(status_unchanged, 1);
+		return;
+	}
+
+	free(bar->status);
+	bar->status = compile_status(data, len, true);
+	bar->relayout = true;
+	bar->redraw = true;
+}
+
+/* Splits "NAME rest" into the name's length and the rest after spaces */
+static size_t
+split_name(char *data, size_t len, char **rest, size_t *rest_l)
+{
+	char *space = memchr(data, ' ', len);
+	size_t name_l = space ? (size_t)(space - data) : len;
+	for (*rest = data + name_l; *rest < data + len && **rest == ' '; (*rest)++);
+	*rest_l = data + len - *rest;
+	return name_l;
+}
+
+/* Returns the bar's block with the given name, adding it at the right end
+ * if asked to */
+static Block *
+find_block(Bar *bar, char *name, size_t name_l, bool add)
+{
+	Block *block;
+	wl_list_for_each(block, &bar->block_list, link)
+		if (strlen(block->name) == name_l && !strncmp(block->name, name, name_l))
+			return block;
+	if (!add)
+		return NULL;
+
+	if (!(block = calloc(1, sizeof(Block))) || !(block->name = strndup(name, name_l)))
+		EDIE("calloc");
+	block->status = compile_status("", 0, true);
+	wl_list_insert(bar->block_list.prev, &block->link);
+	return block;
+}
+
+/* Sets the text of a named block; empty text removes the block */
+static const char *
+set_block(Bar *bar, char *data, size_t len)
+{
+	char *text;
+	size_t text_l, name_l = split_name(data, len, &text, &text_l);
+	if (!name_l)
+		return "missing block name";
+	Block *block = find_block(bar, data, name_l, text_l);
+	if (!block)
+		return NULL;
+
+	if (!text_l) {
+		destroy_block(block);
+	} else if (block->status->hash != hash_bytes(HASH_INIT, text, text_l)) {
+		free(block->status);
+		block->status = compile_status(text, text_l, true);
+	} else {
+		return NULL;
+	}
+	bar->relayout = true;
+	bar->redraw = true;
+	return NULL;
+}
+
+static const char *
+set_block_priority(Bar *bar, char *data, size_t len)
+{
+	char *priority, *end, buf[16];
+	size_t priority_l, name_l = split_name(data, len, &priority, &priority_l);
+	if (!name_l)
+		return "missing block name";
+	Block *block = find_block(bar, data, name_l, false);
+	if (!block)
+		return "no such block";
+
+	if (!priority_l || priority_l >= sizeof(buf))
+		return "invalid priority";
+	memcpy(buf, priority, priority_l);
+	buf[priority_l] = '\0';
+	errno = 0;
+	long value = strtol(buf, &end, 10);
+	if (*end || errno || value < INT32_MIN || value > INT32_MAX)
+		return "invalid priority";
+	if (block->priority == value)
+		return NULL;
+	block->priority = value;
+	bar->relayout = true;
+	bar->redraw = true;
+	return NULL;
+}
+
+static const char *
+queue_status(Bar *bar, char *data, size_t len)
+{
+	/* Superseded by any later status for the same bar in this read */
+	STAT_ADD(status_updates, 1);
+	if (bar->pending_status)
+		STAT_ADD(status_superseded, 1);
+	bar->pending_status = data;
+	bar->pending_status_l = len;
+	return NULL;
+}
+
+static const char *
+set_visible(Bar *bar, char *data, size_t len)
+{
+	if (bar->hidden)
+		show_bar(bar);
+	return NULL;
+}
+
+static const char *
+set_invisible(Bar *bar, char *data, size_t len)
+{
+	if (!bar->hidden)
+		hide_bar(bar);
+	return NULL;
+}
+
+static const char *
+toggle_visibility(Bar *bar, char *data, size_t len)
+{
+	if (bar->hidden)
+		show_bar(bar);
+	else
+		hide_bar(bar);
+	return NULL;
+}
+
+static const char *
+set_top(Bar *bar, char *data, size_t len)
+{
+	if (!bar->hidden) {
+		zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
+						 ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
+						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
+						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+		bar->surfaces[SURFACE_MAIN].uncommitted = true;
+		bar->redraw = true;
+	}
+	bar->bottom = false;
+	return NULL;
+}
+
+static const char *
+set_bottom(Bar *bar, char *data, size_t len)
+{
+	if (!bar->hidden) {
+		zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
+						 ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM
+						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
+						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+		bar->surfaces[SURFACE_MAIN].uncommitted = true;
+		bar->redraw = true;
+	}
+	bar->bottom = true;
+	return NULL;
+}
+
+static const char *
+toggle_location(Bar *bar, char *data, size_t len)
+{
+	return bar->bottom ? set_top(bar, NULL, 0) : set_bottom(bar, NULL, 0);
+}
+
+static int
+advance_word(char **beg, char **end)
+{
+	for (*beg = *end; **beg == ' '; (*beg)++);
+	for (*end = *beg; **end && **end != ' '; (*end)++);
+	if (!**end)
+		/* last word */
+		return -1;
+	**end = '\0';
+	(*end)++;
+	return 0;
+}
+
+static void
+line_reader_init(LineReader *reader, size_t max_line)
+{
+	/* Room for the longest line with its newline, or the longest frame
+	 * with its header, and one byte more */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (max_line + FRAME_HEADER_SIZE + page) / page * page;
+
+	int fd = allocate_shm_file(size);
+	if (fd == -1)
+		EDIE("allocate_shm_file");
+
+	/* Reserve room for both views, then map the file into each half */
+	char *data = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED
+	    || mmap(data, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	    || mmap(data + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		EDIE("mmap");
+	close(fd);
+
+	*reader = (LineReader){ .data = data, .size = size, .max_line = max_line };
+}
+
+static void
+line_reader_finish(LineReader *reader)
+{
+	if (reader->data)
+		munmap(reader->data, reader->size * 2);
+	memset(reader, 0, sizeof(*reader));
+}
+
+static void
+line_reader_consume(LineReader *reader, size_t len)
+{
+	reader->start = (reader->start + len) % reader->size;
+	reader->len -= len;
+	reader->scanned = 0;
+}
+
+/* Payload length from the header of a frame */
+static uint32_t
+frame_length(const char *data)
+{
+	const uint8_t *header = (const uint8_t *)data;
+	return header[4] | header[5] << 8 | header[6] << 16 | (uint32_t)header[7] << 24;
+}
+
+/* Reads as much as fits into the free part of the ring */
+static ssize_t
+line_reader_fill(LineReader *reader, int fd)
+{
+	if (reader->len == reader->size) {
+		/* Every line or frame that is not too long fits with room to
+		 * spare, so a full ring holds nothing that can be parsed. It is
+		 * dropped as too long rather than read into with a length of 0,
+		 * which would look like the end of the file. */
+		size_t skip = reader->binary ? FRAME_HEADER_SIZE + (size_t)frame_length(reader->data + reader->start) : 0;
+		reader->skip = skip > reader->len ? skip - reader->len : 0;
+		reader->discarding = !reader->binary;
+		line_reader_consume(reader, reader->len);
+		STAT_ADD(lines_dropped, 1);
+	}
+
+	ssize_t len;
+	do {
+		len = read(fd, reader->data + (reader->start + reader->len) % reader->size,
+			   reader->size - reader->len);
+	} while (len == -1 && errno == EINTR);
+	if (len > 0)
+		reader->len += len;
+	return len;
+}
+
+/* Returns the next complete line, NUL-terminated in place, or NULL if none
+ * is buffered. Lines stay valid until the next line_reader_fill(). With eof
+ * set, a trailing line without newline is returned as well. */
+static char *
+line_reader_next(LineReader *reader, bool eof)
+{
+	while (reader->len) {
+		char *line = reader->data + reader->start;
+		char *end = memchr(line + reader->scanned, '\n', reader->len - reader->scanned);
+
+		if (!end) {
+			reader->scanned = reader->len;
+			if (reader->discarding) {
+				line_reader_consume(reader, reader->len);
+				return NULL;
+			}
+			if (reader->len > reader->max_line) {
+				/* Too long; cut it off or drop it, then skip
+				 * ahead to the next newline */
+				reader->discarding = true;
+				line_reader_consume(reader, reader->len);
+				if (!truncate_long_lines) {
+					STAT_ADD(lines_dropped, 1);
+					return NULL;
+				}
+				line[reader->max_line] = '\0';
+				return line;
+			}
+			if (!eof)
+				return NULL;
+			line[reader->len] = '\0';
+			line_reader_consume(reader, reader->len);
+			return line;
+		}
+
+		size_t len = end - line;
+		*end = '\0';
+		line_reader_consume(reader, len + 1);
+		if (reader->discarding) {
+			/* Tail of an overlong line */
+			reader->discarding = false;
+			continue;
+		}
+		if (len > reader->max_line) {
+			if (!truncate_long_lines) {
+				STAT_ADD(lines_dropped, 1);
+				continue;
+			}
+			line[reader->max_line] = '\0';
+		}
+		return line;
+	}
+
+	return NULL;
+}
+
+/* Returns the next complete frame of the binary protocol, or false if none
+ * is buffered. The payload stays valid until the next line_reader_fill().
+ * Frames longer than the maximum line length are skipped. */
+static bool
+line_reader_next_frame(LineReader *reader, Frame *frame)
+{
+	for (;;) {
+		if (reader->skip) {
+			size_t len = MIN(reader->skip, reader->len);
+			line_reader_consume(reader, len);
+			reader->skip -= len;
+			if (reader->skip)
+				return false;
+		}
+		if (reader->len < FRAME_HEADER_SIZE)
+			return false;
+
+		/* Little-endian: opcode, reserved, target (16 bits),
+		 * payload length (32 bits) */
+		const uint8_t *header = (uint8_t *)reader->data + reader->start;
+		frame->opcode = header[0];
+		frame->target = header[2] | header[3] << 8;
+		frame->len = frame_length(reader->data + reader->start);
+		if (frame->len > reader->max_line) {
+			reader->skip = FRAME_HEADER_SIZE + (size_t)frame->len;
+			STAT_ADD(lines_dropped, 1);
+			continue;
+		}
+		if (reader->len < FRAME_HEADER_SIZE + frame->len)
+			return false;
+
+		frame->payload = reader->data + reader->start + FRAME_HEADER_SIZE;
+		line_reader_consume(reader, FRAME_HEADER_SIZE + frame->len);
+		return true;
+	}
+}
+
+/* Commands that act on bars. In the binary protocol, opcode n runs
+ * commands[n - 1]; opcode 0 binds a target id to an output name. */
+static const Command commands[] = {
+	{ "status", queue_status, "missing status text" },
+	{ "block", set_block, "missing block name" },
+	{ "block-priority", set_block_priority, "missing block name" },
+	{ "show", set_visible, NULL },
+	{ "hide", set_invisible, NULL },
+	{ "toggle-visibility", toggle_visibility, NULL },
+	{ "set-top", set_top, NULL },
+	{ "set-bottom", set_bottom, NULL },
+	{ "toggle-location", toggle_location, NULL },
+};
+
+/* Runs one command line; returns an error message or NULL */
+static const char *
+run_command(char *line)
+{
+	char *wordbeg, *wordend = line;
+	if (advance_word(&wordbeg, &wordend) == -1)
+		return "missing command";
+	char *output = wordbeg;
+	advance_word(&wordbeg, &wordend);
+
+	const Command *command = NULL;
+	for (size_t i = 0; i < LENGTH(commands) && !command; i++)
+		if (!strcmp(wordbeg, commands[i].name))
+			command = &commands[i];
+	if (!command)
+		return "unknown command";
+	if (command->missing && (!*wordend || *wordend == ' '))
+		return command->missing;
+	size_t len = strlen(wordend);
+	
+	/* Runs on every targeted bar and reports the first error */
+	Bar *bar;
+	const char *err = NULL, *bar_err;
+	if (!strcmp(output, "all")) {
+		wl_list_for_each(bar, &bar_list, link)
+			if ((bar_err = command->func(bar, wordend, len)) && !err)
+				err = bar_err;
+	} else if (!strcmp(output, "selected")) {
+		wl_list_for_each(bar, &bar_list, link)
+			if (bar->sel && (bar_err = command->func(bar, wordend, len)) && !err)
+				err = bar_err;
+	} else {
+		wl_list_for_each(bar, &bar_list, link)
+			if (bar->output_name && !strcmp(output, bar->output_name))
+				return command->func(bar, wordend, len);
+		return "no such output";
+	}
+
+	return err;
+}
+
+/* Binds a target id to an output name, so that frames need no name lookup */
+static const char *
+bind_target(uint16_t id, const char *name, size_t len)
+{
+	if (id >= TARGET_SELECTED)
+		return "reserved target";
+	if (!len)
+		return "missing output name";
+
+	Binding *binding;
+	wl_list_for_each(binding, &binding_list, link)
+		if (binding->id == id)
+			break;
+	if (&binding->link == &binding_list) {
+		if (!(binding = calloc(1, sizeof(Binding))))
+			EDIE("calloc");
+		binding->id = id;
+		wl_list_insert(&binding_list, &binding->link);
+	} else {
+		free(binding->name);
+	}
+	if (!(binding->name = strndup(name, len)))
+		EDIE("strndup");
+
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link)
+		if (bar->output_name)
+			bar->bind_id = find_binding(bar->output_name);
+	return NULL;
+}
+
+/* Runs one binary frame; returns an error message or NULL */
+static const char *
+run_frame(Frame *frame)
+{
+	if (frame->opcode == 0)
+		return bind_target(frame->target, frame->payload, frame->len);
+	if (frame->opcode > LENGTH(commands))
+		return "unknown command";
+	const Command *command = &commands[frame->opcode - 1];
+	if (command->missing && !frame->len)
+		return command->missing;
+
+	Bar *bar;
+	bool found = false;
+	const char *err = NULL, *bar_err;
+	wl_list_for_each(bar, &bar_list, link) {
+		if (frame->target == TARGET_ALL || (frame->target == TARGET_SELECTED && bar->sel)
+		    || bar->bind_id == frame->target) {
+			if ((bar_err = command->func(bar, frame->payload, frame->len)) && !err)
+				err = bar_err;
+			found = true;
+		}
+	}
+	if (!found && frame->target < TARGET_SELECTED)
+		return "no such output";
+
+	return err;
+}
+
+/* Applies only the latest status queued for each bar */
+static void
+apply_pending_status(void)
+{
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		if (bar->pending_status) {
+			set_status(bar, bar->pending_status, bar->pending_status_l);
+			bar->pending_status = NULL;
+		}
+	}
+}
+
+/* Writes the counters, one "name value" per line, and returns the length
+ * that the whole text needs. Frames per bar and held buffers are always
+ * known; the rest needs -stats. */
+static size_t
+format_stats(char *buf, size_t size)
+{
+	size_t len = 0;
+#define APPEND(...) (len += snprintf(buf + MIN(len, size), size - MIN(len, size), __VA_ARGS__))
+
+	uint32_t held = 0;
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		APPEND("frames %s %lu\n", bar->output_name ? bar->output_name : "-", (unsigned long)bar->frames);
+		for (uint32_t i = 0; i < bar->surfaces_l; i++) {
+			Surface *surface = &bar->surfaces[i];
+			for (int j = 0; j < BUFFERS; j++) {
+				Buffer *buffer = &surface->pool.buffers[j];
+				if (buffer->busy && !(surface->rendering && surface->job.buffer == buffer))
+					held++;
+			}
+		}
+	}
+	APPEND("buffers_held %u\n", held);
+	if (!stats_enabled) {
+		APPEND("counters disabled\n");
+		return len;
+	}
+
+#define LOAD(counter) ((unsigned long)atomic_load_explicit(&stats.counter, memory_order_relaxed))
+	unsigned long renders = 0;
+	APPEND("render_time_us");
+	for (int i = 0; i < RENDER_BUCKETS; i++) {
+		renders += LOAD(render_time[i]);
+		if (i < RENDER_BUCKETS - 1)
+			APPEND(" <%u:%lu", render_bucket_us[i], LOAD(render_time[i]));
+		else
+			APPEND(" >=%u:%lu", render_bucket_us[i - 1], LOAD(render_time[i]));
+	}
+	APPEND("\nrender_time_avg_us %.1f\n", renders ? LOAD(render_ns) / 1000.0 / renders : 0.0);
+	APPEND("status_updates %lu\n", LOAD(status_updates));
+	APPEND("status_superseded %lu\n", LOAD(status_superseded));
+	APPEND("status_unchanged %lu\n", LOAD(status_unchanged));
+	APPEND("lines_dropped %lu\n", LOAD(lines_dropped));
+	APPEND("buffers_allocated %lu\n", LOAD(buffers_allocated));
+	APPEND("buffer_waits %lu\n", LOAD(buffer_waits));
+	APPEND("redraws_skipped %lu\n", LOAD(redraws_skipped));
+	APPEND("glyph_rasterizations %lu\n", LOAD(rasterizations));
+	APPEND("kerning_calls %lu\n", LOAD(kerning_calls));
+	APPEND("wakeups %lu\n", LOAD(wakeups));
+#undef LOAD
+#undef APPEND
+	return len;
+}
+
+/* Prints the counters to stderr, on SIGUSR1 or "stats" on stdin */
+static void
+dump_stats(void)
+{
+	size_t len = format_stats(NULL, 0);
+	char buf[len + 1];
+	format_stats(buf, sizeof(buf));
+	fputs(buf, stderr);
+}
+
+static int
+read_stdin(void)
+{
+	/* Drain everything that is available */
+	for (;;) {
+		ssize_t len = line_reader_fill(&stdin_reader, STDIN_FILENO);
+		if (len == -1) {
+			if (errno == EAGAIN)
+				return 0;
+			EDIE("read");
+		}
+
+		if (stdin_reader.binary) {
+			Frame frame;
+			while (line_reader_next_frame(&stdin_reader, &frame))
+				run_frame(&frame);
+		} else {
+			char *line;
+			while ((line = line_reader_next(&stdin_reader, len == 0))) {
+				if (!strcmp(line, "stats"))
+					dump_stats();
+				else
+					run_command(line);
+			}
+		}
+
+		/* Queued statuses point into the ring, so they are applied
+		 * before its space is reused */
+		apply_pending_status();
+
+		if (len == 0)
+			return -1;
+	}
+}
+
+/* Draws dirty surfaces that are due and returns the time until the next one
+ * is, or -1 if no surface is waiting on a deadline. A surface is due once
+ * the compositor has answered its last frame callback; surfaces that stop
+ * getting callbacks (e.g. on a disabled output) fall back to the output's
+ * refresh rate. */
+static int64_t
+render_frames(void)
+{
+	uint64_t now = now_ns();
+	int64_t timeout = -1;
+
+	Bar *bar;
+	Surface *due_surfaces[wl_list_length(&bar_list) * SURFACES + 1];
+	int due_l = 0;
+	wl_list_for_each(bar, &bar_list, link) {
+		if (!bar->redraw)
+			continue;
+		if (bar->hidden || !bar->configured) {
+			bar->redraw = false;
+			continue;
+		}
+
+		/* Bars with a frame on a render worker are looked at again
+		 * once it is committed, as the layout must not change under
+		 * it */
+		bool rendering = false;
+		for (uint32_t i = 0; i < bar->surfaces_l; i++)
+			rendering |= bar->surfaces[i].rendering;
+		if (rendering)
+			continue;
+
+		update_surfaces(bar);
+
+		/* Refresh rate is reported in mHz */
+		uint64_t period = 1000000000000ull / (bar->refresh ? bar->refresh : 60000);
+		bool waiting = false;
+		for (uint32_t i = 0; i < bar->surfaces_l; i++) {
+			Surface *surface = &bar->surfaces[i];
+			if (!surface_dirty(surface)) {
+				STAT_ADD(redraws_skipped, 1);
+				continue;
+			}
+
+			uint64_t due = surface->last_frame;
+			if (max_fps)
+				due += 1000000000ull / max_fps;
+			if (surface->frame_callback)
+				due = MAX(due, surface->last_frame + period * 2);
+
+			if (due > now) {
+				if (timeout == -1 || (int64_t)(due - now) < timeout)
+					timeout = due - now;
+				waiting = true;
+				continue;
+			}
+
+			due_surfaces[due_l++] = surface;
+		}
+		bar->redraw = waiting;
+	}
+
+	/* Surfaces whose buffers are all held by the compositor keep their
+	 * bar marked until a release event arrives. A single due surface is
+	 * drawn right away, which is cheaper than handing it to a worker.
+	 * A bar's due surfaces are next to each other, and however many of
+	 * them are drawn, the bar counts one frame. */
+	Bar *counted = NULL;
+	for (int i = 0; i < due_l; i++) {
+		bar = due_surfaces[i]->bar;
+		if (draw_frame(due_surfaces[i], render_workers_l && due_l > 1) == -1) {
+			STAT_ADD(buffer_waits, 1);
+			bar->redraw = true;
+		} else if (bar != counted) {
+			bar->frames++;
+			counted = bar;
+		}
+	}
+
+	return timeout;
+}
+
+static EventSource *
+add_source(int fd, uint32_t events, void (*handler)(EventSource *, uint32_t), void *data)
+{
+	EventSource *source = calloc(1, sizeof(EventSource));
+	if (!source)
+		EDIE("calloc");
+	source->fd = fd;
+	source->handler = handler;
+	source->data = data;
+
+	struct epoll_event event = { .events = events, .data.ptr = source };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		free(source);
+		return NULL;
+	}
+	wl_list_insert(&source_list, &source->link);
+	return source;
+}
+
+static EventSource *
+add_timer(clockid_t clock, void (*handler)(EventSource *, uint32_t), void *data)
+{
+	int fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		EDIE("timerfd_create");
+	EventSource *source = add_source(fd, EPOLLIN, handler, data);
+	if (!source)
+		EDIE("epoll_ctl");
+	source->timer = true;
+	return source;
+}
+
+/* Arms a timer source to fire after (or, with TFD_TIMER_ABSTIME in flags,
+ * at) value nanoseconds and every interval nanoseconds after that. A value
+ * of 0 disarms it. */
+static void
+set_timer(EventSource *source, uint64_t value, uint64_t interval, int flags)
+{
+	struct itimerspec spec = {
+		.it_value = { .tv_sec = value / 1000000000, .tv_nsec = value % 1000000000 },
+		.it_interval = { .tv_sec = interval / 1000000000, .tv_nsec = interval % 1000000000 },
+	};
+	if (timerfd_settime(source->fd, flags, &spec, NULL) == -1)
+		EDIE("timerfd_settime");
+}
+
+/* Sources are freed once the current batch of events has been handled, as
+ * later events in it may still point at them */
+static void
+remove_source(EventSource *source)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	if (source->timer)
+		close(source->fd);
+	source->fd = -1;
+	wl_list_remove(&source->link);
+	wl_list_insert(&removed_sources, &source->link);
+}
+
+static void
+free_removed_sources(void)
 {
-	if (bar->title)
-		free(bar->title);
-	if (bar->layout)
-		free(bar->layout);
-	if (bar->status)
-		free(bar->status);
-	if (bar->output_name)
-		free(bar->output_name);
-	zriver_output_status_v1_destroy(bar->river_output_status);
-	if (!bar->hidden) {
-		zwlr_layer_surface_v1_destroy(bar->layer_surface);
-		wl_surface_destroy(bar->wl_surface);
+	EventSource *source, *tmp;
+	wl_list_for_each_safe(source, tmp, &removed_sources, link) {
+		wl_list_remove(&source->link);
+		free(source);
 	}
-	wl_output_destroy(bar->wl_output);
-	free(bar);
 }
 
 static void
-teardown_seat(Seat *seat)
+set_source_events(EventSource *source, uint32_t events)
 {
-	if (seat->mode)
-		free(seat->mode);
-	zriver_seat_status_v1_destroy(seat->river_seat_status);
-	if (seat->wl_pointer)
-		wl_pointer_destroy(seat->wl_pointer);
-	wl_seat_destroy(seat->wl_seat);
-	free(seat);
+	struct epoll_event event = { .events = events, .data.ptr = source };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &event) == -1)
+		EDIE("epoll_ctl");
 }
 
+/* Formats a byte count the way free -h and df -h do */
 static void
-handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+format_size(char *buf, size_t size, double bytes)
 {
-	Bar *bar;
-	Seat *seat;
-	
-	wl_list_for_each(bar, &bar_list, link) {
-		if (bar->registry_name == name) {
-			wl_list_remove(&bar->link);
-			teardown_bar(bar);
-			return;
-		}
-	}
-	wl_list_for_each(seat, &seat_list, link) {
-		if (seat->registry_name == name) {
-			wl_list_remove(&seat->link);
-			teardown_seat(seat);
-			return;
-		}
+	const char *units = "BKMGTP";
+	while (bytes >= 1024 && units[1]) {
+		bytes /= 1024;
+		units++;
 	}
+	snprintf(buf, size, bytes < 10 && *units != 'B' ? "%.1f%c" : "%.0f%c", bytes, *units);
 }
 
-static const struct wl_registry_listener registry_listener = {
-	.global = handle_global,
-	.global_remove = handle_global_remove
-};
+static void
+module_load(char *buf, size_t size)
+{
+	FILE *f = fopen("/proc/loadavg", "r");
+	if (!f)
+		return;
+	if (fscanf(f, "%15s", buf) != 1)
+		*buf = '\0';
+	fclose(f);
+}
 
 static void
-set_status(Bar *bar, char *data)
+module_memory(char *buf, size_t size)
 {
-	if (bar->status)
-		free(bar->status);
-	if (!(bar->status = strdup(data)))
-		EDIE("strdup");
-	bar->redraw = true;
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return;
+	unsigned long long total = 0, available = 0, value;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "MemTotal: %llu kB", &value) == 1)
+			total = value;
+		else if (sscanf(line, "MemAvailable: %llu kB", &value) == 1)
+			available = value;
+	}
+	fclose(f);
+	if (total)
+		format_size(buf, size, (total - MIN(available, total)) * 1024.0);
 }
 
 static void
-set_visible(Bar *bar, char *data)
+module_disk(char *buf, size_t size)
 {
-	if (bar->hidden)
-		show_bar(bar);
+	struct statvfs st;
+	if (statvfs(disk_path, &st) == 0)
+		format_size(buf, size, (double)st.f_bavail * st.f_frsize);
 }
 
 static void
-set_invisible(Bar *bar, char *data)
+module_battery(char *buf, size_t size)
 {
-	if (!bar->hidden)
-		hide_bar(bar);
+	char path[256], status[32] = "", capacity[8] = "";
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/power_supply/%s/status", battery);
+	if ((f = fopen(path, "r"))) {
+		if (fscanf(f, "%31s", status) != 1)
+			*status = '\0';
+		fclose(f);
+	}
+	snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity", battery);
+	if ((f = fopen(path, "r"))) {
+		if (fscanf(f, "%7s", capacity) != 1)
+			*capacity = '\0';
+		fclose(f);
+	}
+	if (*status || *capacity)
+		snprintf(buf, size, "%s %s%%", status, capacity);
 }
 
 static void
-toggle_visibility(Bar *bar, char *data)
+module_clock(char *buf, size_t size)
 {
-	if (bar->hidden)
-		show_bar(bar);
-	else
-		hide_bar(bar);
+	time_t now = time(NULL);
+	struct tm tm;
+	if (!localtime_r(&now, &tm) || !strftime(buf, size, clock_format, &tm))
+		*buf = '\0';
 }
 
+static const ModuleType module_types[] = {
+	{ "load", module_load, 15 },
+	{ "memory", module_memory, 15 },
+	{ "disk", module_disk, 15 },
+	{ "battery", module_battery, 60 },
+	{ "clock", module_clock, 0 },
+};
+
+/* The clock ticks on the wall clock's second or minute boundary, depending
+ * on whether its format shows seconds, or on multiples of its interval if
+ * one was given */
 static void
-set_top(Bar *bar, char *data)
+arm_clock(Module *module)
 {
-	if (!bar->hidden) {
-		zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
-						 ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP
-						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
-						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
+	uint64_t step = module->interval ? module->interval : 60;
+	for (char *p = clock_format; !module->interval && (p = strchr(p, '%')) && p[1]; p += 2)
+		if (strchr("STsrXc", p[1]))
+			step = 1;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t next = ((uint64_t)ts.tv_sec / step + 1) * step;
+	set_timer(module->timer, next * 1000000000, 0, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET);
+}
+
+static void
+update_module(Module *module)
+{
+	char buf[256] = "";
+	module->type->update(buf, sizeof(buf));
+
+	/* Only this module's piece of the status changes */
+	if (module->status && module->status->hash == hash_bytes(HASH_INIT, buf, strlen(buf)))
+		return;
+	/* Module text, e.g. from a user's clock format, is shown as is */
+	free(module->status);
+	module->status = compile_status(buf, strlen(buf), false);
+
+	Bar *bar;
+	wl_list_for_each(bar, &bar_list, link) {
+		bar->relayout = true;
 		bar->redraw = true;
 	}
-	bar->bottom = false;
 }
 
 static void
-set_bottom(Bar *bar, char *data)
+module_handler(EventSource *source, uint32_t events)
 {
-	if (!bar->hidden) {
-		zwlr_layer_surface_v1_set_anchor(bar->layer_surface,
-						 ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM
-						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT
-						 | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT);
-		bar->redraw = true;
+	Module *module = source->data;
+
+	update_module(module);
+	if (module->type->update == module_clock)
+		arm_clock(module);
+}
+
+static void
+add_module(const char *arg)
+{
+	size_t name_l = strcspn(arg, ":");
+	const ModuleType *type = NULL;
+	for (size_t i = 0; i < LENGTH(module_types); i++)
+		if (strlen(module_types[i].name) == name_l && !strncmp(arg, module_types[i].name, name_l))
+			type = &module_types[i];
+	if (!type)
+		DIE("-module: unknown module '%.*s'", (int)name_l, arg);
+
+	Module *module = calloc(1, sizeof(Module));
+	if (!module)
+		EDIE("calloc");
+	module->type = type;
+	module->interval = arg[name_l] ? strtoul(arg + name_l + 1, NULL, 10) : type->interval;
+	if ((arg[name_l] || type->update != module_clock) && !module->interval)
+		DIE("-module: invalid interval for '%s'", type->name);
+	wl_list_insert(module_list.prev, &module->link);
+}
+
+static void
+start_modules(void)
+{
+	Module *module;
+	wl_list_for_each(module, &module_list, link) {
+		update_module(module);
+		if (module->type->update == module_clock) {
+			module->timer = add_timer(CLOCK_REALTIME, module_handler, module);
+			arm_clock(module);
+		} else {
+			uint64_t interval = module->interval * 1000000000ull;
+			module->timer = add_timer(CLOCK_MONOTONIC, module_handler, module);
+			set_timer(module->timer, interval, interval, 0);
+		}
 	}
-	bar->bottom = true;
 }
 
 static void
-toggle_location(Bar *bar, char *data)
+client_destroy(Client *client)
 {
-	if (bar->bottom)
-		set_top(bar, NULL);
-	else
-		set_bottom(bar, NULL);
+	int fd = client->source->fd;
+	remove_source(client->source);
+	close(fd);
+	line_reader_finish(&client->reader);
+	wl_list_remove(&client->link);
+	free(client);
 }
 
+/* Sends as much of the pending replies as the socket takes. While some are
+ * left, the client is not read from, so a client that does not read its
+ * acknowledgements cannot make us queue more. */
 static int
-advance_word(char **beg, char **end)
+client_flush(Client *client)
 {
-	for (*beg = *end; **beg == ' '; (*beg)++);
-	for (*end = *beg; **end && **end != ' '; (*end)++);
-	if (!**end)
-		/* last word */
-		return -1;
-	**end = '\0';
-	(*end)++;
+	while (client->reply_l) {
+		ssize_t len = send(client->source->fd, client->reply, client->reply_l, MSG_NOSIGNAL);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			break;
+		}
+		memmove(client->reply, client->reply + len, client->reply_l - len);
+		client->reply_l -= len;
+	}
+	set_source_events(client->source, client->reply_l ? EPOLLOUT : EPOLLIN);
 	return 0;
 }
 
-static int
-read_stdin(void)
+/* Queues a reply; client_run() keeps room for one, so it always fits */
+static void
+client_reply(Client *client, const char *fmt, ...)
 {
-	char buf[8192];
-	ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
-	if (len == -1)
-		EDIE("read");
-	if (len == 0)
-		return -1;
-	
-	char *linebeg, *lineend, *wordbeg, *wordend;
-	for (linebeg = (char *)&buf;
-	     (lineend = memchr(linebeg, '\n', (char *)&buf + len - linebeg));
-	     linebeg = lineend) {
-		*lineend++ = '\0';
-
-		wordend = linebeg;
-		if (advance_word(&wordbeg, &wordend) == -1)
-			continue;
-		char *output = wordbeg;
-		advance_word(&wordbeg, &wordend);
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(client->reply + client->reply_l,
+			    sizeof(client->reply) - client->reply_l, fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		client->reply_l += MIN((size_t)len, sizeof(client->reply) - client->reply_l - 1);
+}
 
-		void (*func)(Bar *, char *);
-		if (!strcmp(wordbeg, "status")) {
-			if (!*wordend)
-				continue;
-			func = set_status;
-		} else if (!strcmp(wordbeg, "show")) {
-			func = set_visible;
-		} else if (!strcmp(wordbeg, "hide")) {
-			func = set_invisible;
-		} else if (!strcmp(wordbeg, "toggle-visibility")) {
-			func = toggle_visibility;
-		} else if (!strcmp(wordbeg, "set-top")) {
-			func = set_top;
-		} else if (!strcmp(wordbeg, "set-bottom")) {
-			func = set_bottom;
-		} else if (!strcmp(wordbeg, "toggle-location")) {
-			func = toggle_location;
-		} else {
-			continue;
-		}
-		
-		Bar *bar;
-		if (!strcmp(output, "all")) {
-			wl_list_for_each(bar, &bar_list, link)
-				func(bar, wordend);
-		} else if (!strcmp(output, "selected")) {
-			wl_list_for_each(bar, &bar_list, link)
-				if (bar->sel)
-					func(bar, wordend);
+/* Runs the client's buffered commands while the reply buffer has room for
+ * another reply. Returns false once none are left, or true if some wait
+ * for the replies to be sent. */
+static bool
+client_run(Client *client)
+{
+	bool full = false;
+	while (!(full = sizeof(client->reply) - client->reply_l <= CLIENT_REPLY_MAX)) {
+		/* A client switches to the binary protocol for the rest of
+		 * its connection by sending the line "binary" */
+		const char *err;
+		if (client->reader.binary) {
+			Frame frame;
+			if (!line_reader_next_frame(&client->reader, &frame))
+				break;
+			err = run_frame(&frame);
 		} else {
-			wl_list_for_each(bar, &bar_list, link) {
-				if (bar->output_name && !strcmp(output, bar->output_name)) {
-					func(bar, wordend);
-					break;
-				}
+			char *line = line_reader_next(&client->reader, client->eof);
+			if (!line)
+				break;
+			if (!strcmp(line, "ack")) {
+				client->ack = true;
+				continue;
+			}
+			if (!strcmp(line, "binary")) {
+				client->reader.binary = true;
+				continue;
 			}
+			if (!strcmp(line, "stats")) {
+				/* Replied to whether or not acks were asked for,
+				 * followed by an empty line. Cut short if it
+				 * does not fit in a reply. */
+				char buf[CLIENT_REPLY_MAX - 1];
+				format_stats(buf, sizeof(buf));
+				client_reply(client, "%s\n", buf);
+				continue;
+			}
+			err = run_command(line);
+		}
+		if (client->ack) {
+			if (err)
+				client_reply(client, "error %s\n", err);
+			else
+				client_reply(client, "ok\n");
 		}
 	}
-	
-	return 0;
+
+	/* Queued statuses point into the reader, whose space is reused once
+	 * the client is read from again */
+	apply_pending_status();
+	return full;
+}
+
+static void
+client_handler(EventSource *source, uint32_t events)
+{
+	Client *client = source->data;
+
+	if (events & (EPOLLERR | EPOLLHUP) && !(events & (EPOLLIN | EPOLLOUT))) {
+		client_destroy(client);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		/* Commands left in the reader go on once the replies are out */
+		if (client_flush(client) == -1) {
+			client_destroy(client);
+			return;
+		}
+		if (client->reply_l)
+			return;
+	} else {
+		/* One read per wakeup, so that a busy client cannot starve
+		 * the others; epoll reports it again if more is left */
+		ssize_t len = line_reader_fill(&client->reader, source->fd);
+		if (len == -1 && errno == EAGAIN)
+			return;
+		if (len <= 0)
+			client->eof = true;
+	}
+
+	bool full;
+	do {
+		full = client_run(client);
+		if (client_flush(client) == -1) {
+			client_destroy(client);
+			return;
+		}
+	} while (full && !client->reply_l);
+
+	if (client->eof && !full)
+		client_destroy(client);
+}
+
+static void
+socket_handler(EventSource *source, uint32_t events)
+{
+	int fd;
+	while ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if ((uint32_t)wl_list_length(&client_list) >= CLIENTS_MAX) {
+			close(fd);
+			continue;
+		}
+		Client *client = calloc(1, sizeof(Client));
+		if (!client)
+			EDIE("calloc");
+		if (!(client->source = add_source(fd, EPOLLIN, client_handler, client)))
+			EDIE("epoll_ctl");
+		line_reader_init(&client->reader, max_line_length);
+		wl_list_insert(&client_list, &client->link);
+	}
+}
+
+/* Listens on the control socket, replacing a stale one left behind by a
+ * previous instance. Returns the listening fd or -1. */
+static int
+setup_socket(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path too long: %s\n", socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		EDIE("socket");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Control socket %s is in use\n", socket_path);
+		close(fd);
+		return -1;
+	}
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+	    || listen(fd, SOMAXCONN) == -1) {
+		fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+stdin_handler(EventSource *source, uint32_t events)
+{
+	/* Closing a piped stdin quits, as does closing stdin without a
+	 * control socket */
+	if (read_stdin() == -1) {
+		if (socket_fd == -1 || stdin_pipe)
+			run_display = false;
+		else
+			remove_source(source);
+	}
+}
+
+static void
+signal_handler(EventSource *source, uint32_t events)
+{
+	struct signalfd_siginfo info;
+	while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGINT || info.ssi_signo == SIGHUP || info.ssi_signo == SIGTERM)
+			run_display = false;
+		else if (info.ssi_signo == SIGUSR1)
+			dump_stats();
+	}
+}
+
+static void
+frame_timer_handler(EventSource *source, uint32_t events)
+{
+	/* Due bars are drawn at the top of the loop */
 }
 
 static void
 event_loop(void)
 {
-	int wl_fd = wl_display_get_fd(display);
+	EventSource *wl_source = add_source(wl_display_get_fd(display), EPOLLIN, NULL, NULL);
+	if (!wl_source)
+		EDIE("epoll_ctl");
 
 	while (run_display) {
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(wl_fd, &rfds);
-		FD_SET(STDIN_FILENO, &rfds);
-
-		wl_display_flush(display);
+		int64_t timeout = render_frames();
+		/* A zero value would disarm the timer */
+		set_timer(frame_timer, timeout == -1 ? 0 : MAX(timeout, 1), 0, 0);
+
+		while (wl_display_prepare_read(display) != 0)
+			if (wl_display_dispatch_pending(display) == -1)
+				goto done;
+		if (wl_display_flush(display) == -1 && errno != EAGAIN) {
+			wl_display_cancel_read(display);
+			break;
+		}
 
-		if (select(wl_fd + 1, &rfds, NULL, NULL, NULL) == -1) {
+		struct epoll_event events[16];
+		int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n == -1) {
+			wl_display_cancel_read(display);
 			if (errno == EINTR)
 				continue;
-			else
-				EDIE("select");
+			EDIE("epoll_wait");
 		}
-		
-		if (FD_ISSET(wl_fd, &rfds))
-			if (wl_display_dispatch(display) == -1)
+		STAT_ADD(wakeups, 1);
+
+		/* Wayland events are read and dispatched before other sources
+		 * run, so they see the compositor's latest state */
+		bool wl_readable = false;
+		for (int i = 0; i < n; i++)
+			if (events[i].data.ptr == wl_source)
+				wl_readable = true;
+		if (wl_readable) {
+			if (wl_display_read_events(display) == -1)
 				break;
-		if (FD_ISSET(STDIN_FILENO, &rfds))
-			if (read_stdin() == -1)
-				break;
-		
-		Bar *bar;
-		wl_list_for_each(bar, &bar_list, link) {
-			if (bar->redraw) {
-				if (!bar->hidden)
-					draw_frame(bar);
-				bar->redraw = false;
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (wl_display_dispatch_pending(display) == -1)
+			break;
+
+		for (int i = 0; i < n; i++) {
+			EventSource *source = events[i].data.ptr;
+			if (source == wl_source || source->fd == -1)
+				continue;
+			if (source->timer) {
+				/* A timer cancelled by a change of the wall clock
+				 * still runs its handler so that it can be rearmed */
+				uint64_t expirations;
+				if (read(source->fd, &expirations, sizeof(expirations)) == -1 && errno != ECANCELED)
+					continue;
 			}
+			source->handler(source, events[i].events);
 		}
+
+		free_removed_sources();
 	}
+done:
+	remove_source(wl_source);
+}
+
+/* Resolves and opens the font, which involves fontconfig matching but
+ * nothing from the compositor */
+static void *
+load_font(void *data)
+{
+	uint64_t start = now_ns();
+	font = load_font_at(buffer_scale * 120);
+	font_load_time = now_ns() - start;
+	return NULL;
 }
 
-void
-sig_handler(int sig)
+/* Adds a comma separated list of hexadecimal codepoints and ranges, such as
+ * "f000-f2e0,e0b0", to the codepoints rasterized at startup */
+static void
+add_prewarm(const char *arg)
 {
-	if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM)
-		run_display = false;
+	for (const char *p = arg; *p; p += *p == ',') {
+		char *end;
+		uint32_t first = strtoul(p, &end, 16), last = first;
+		if (end == p)
+			DIE("-prewarm: invalid argument");
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 16);
+			if (end == p || last < first)
+				DIE("-prewarm: invalid argument");
+		}
+		if (*end && *end != ',')
+			DIE("-prewarm: invalid argument");
+		p = end;
+
+		if (!(prewarm_codepoints = realloc(prewarm_codepoints,
+						   (prewarm_codepoints_l + last - first + 1) * sizeof(uint32_t))))
+			EDIE("realloc");
+		for (uint32_t cp = first; cp <= last; cp++)
+			prewarm_codepoints[prewarm_codepoints_l++] = cp;
+	}
 }
 
 int
@@ -1241,6 +4054,11 @@ main(int argc, char **argv)
 {
 	Bar *bar, *bar2;
 	Seat *seat, *seat2;
+	Module *module, *module2;
+
+	startup_time = now_ns();
+	wl_list_init(&module_list);
+	wl_list_init(&binding_list);
 
 	/* Parse options */
 	for (int i = 1; i < argc; i++) {
@@ -1272,6 +4090,48 @@ main(int argc, char **argv)
 			if (++i >= argc)
 				DIE("Option -scale requires an argument");
 			buffer_scale = strtoul(argv[i], &argv[i] + strlen(argv[i]), 10);
+		} else if (!strcmp(argv[i], "-max-fps")) {
+			if (++i >= argc)
+				DIE("Option -max-fps requires an argument");
+			max_fps = strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "-max-line-length")) {
+			if (++i >= argc)
+				DIE("Option -max-line-length requires an argument");
+			if (!(max_line_length = strtoul(argv[i], NULL, 10)))
+				DIE("-max-line-length: invalid argument");
+		} else if (!strcmp(argv[i], "-line-overflow")) {
+			if (++i >= argc)
+				DIE("Option -line-overflow requires an argument");
+			if (!strcmp(argv[i], "truncate"))
+				truncate_long_lines = true;
+			else if (!strcmp(argv[i], "discard"))
+				truncate_long_lines = false;
+			else
+				DIE("-line-overflow: invalid argument");
+		} else if (!strcmp(argv[i], "-socket")) {
+			if (++i >= argc)
+				DIE("Option -socket requires an argument");
+			socket_path = argv[i];
+		} else if (!strcmp(argv[i], "-no-socket")) {
+			no_socket = true;
+		} else if (!strcmp(argv[i], "-binary")) {
+			binary_stdin = true;
+		} else if (!strcmp(argv[i], "-module")) {
+			if (++i >= argc)
+				DIE("Option -module requires an argument");
+			add_module(argv[i]);
+		} else if (!strcmp(argv[i], "-clock-format")) {
+			if (++i >= argc)
+				DIE("Option -clock-format requires an argument");
+			clock_format = argv[i];
+		} else if (!strcmp(argv[i], "-disk-path")) {
+			if (++i >= argc)
+				DIE("Option -disk-path requires an argument");
+			disk_path = argv[i];
+		} else if (!strcmp(argv[i], "-battery")) {
+			if (++i >= argc)
+				DIE("Option -battery requires an argument");
+			battery = argv[i];
 		} else if (!strcmp(argv[i], "-active-fg-color")) {
 			if (++i >= argc)
 				DIE("Option -active-fg-color requires an argument");
@@ -1312,6 +4172,25 @@ main(int argc, char **argv)
 				DIE("Option -title-bg-color requires an argument");
 			if (parse_color(argv[i], &title_bg_color) == -1)
 				DIE("malformed color string");
+		} else if (!strcmp(argv[i], "-render-threads")) {
+			if (++i >= argc)
+				DIE("Option -render-threads requires an argument");
+			char *end;
+			render_threads = strtol(argv[i], &end, 10);
+			if (*end || render_threads < 0)
+				DIE("-render-threads: invalid argument");
+		} else if (!strcmp(argv[i], "-share-segments")) {
+			share_segments = true;
+		} else if (!strcmp(argv[i], "-subsurfaces")) {
+			subsurfaces = true;
+		} else if (!strcmp(argv[i], "-startup-trace")) {
+			startup_trace = true;
+		} else if (!strcmp(argv[i], "-stats")) {
+			stats_enabled = true;
+		} else if (!strcmp(argv[i], "-prewarm")) {
+			if (++i >= argc)
+				DIE("Option -prewarm requires an argument");
+			add_prewarm(argv[i]);
 		} else if (!strcmp(argv[i], "-tags")) {
 			if (++i + 1 >= argc)
 				DIE("Option -tags requires at least two arguments");
@@ -1341,9 +4220,19 @@ main(int argc, char **argv)
 		}
 	}
 
+	trace_startup("options parsed");
+
+	/* Load the font while the compositor's globals are gathered */
+	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
+	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
+	int err;
+	if ((err = start_thread(&font_thread, load_font, NULL)))
+		DIE("Could not start font thread: %s", strerror(err));
+
 	/* Set up display and protocols */
 	if (!(display = wl_display_connect(NULL)))
 		DIE("Failed to create display");
+	trace_startup("display connected");
 
 	wl_list_init(&bar_list);
 	wl_list_init(&seat_list);
@@ -1353,19 +4242,33 @@ main(int argc, char **argv)
 	wl_display_roundtrip(display);
 	if (!compositor || !shm || !layer_shell || !river_status_manager || !river_control)
 		DIE("Compositor does not support all needed protocols");
+	if (subsurfaces && !subcompositor) {
+		fprintf(stderr, "Compositor does not support subsurfaces, drawing bars on one surface\n");
+		subsurfaces = false;
+	}
+	trace_startup("registry roundtrip done");
 
-	/* Load selected font */
-	fcft_init(FCFT_LOG_COLORIZE_AUTO, 0, FCFT_LOG_CLASS_ERROR);
-	fcft_set_scaling_filter(FCFT_SCALING_FILTER_LANCZOS3);
-
-	unsigned int dpi = 96 * buffer_scale;
-	char buf[10];
-	snprintf(buf, sizeof buf, "dpi=%u", dpi);
-	if (!(font = fcft_from_name(1, (const char *[]) {fontstr}, buf)))
+	/* The font is needed for the bar height from here on */
+	pthread_join(font_thread, NULL);
+	if (!font)
 		DIE("Could not load font");
-	textpadding = font->height / 2;
+	if (startup_trace) {
+		char phase[64];
+		snprintf(phase, sizeof(phase), "font ready (%.3f ms on the font thread)", font_load_time / 1e6);
+		trace_startup(phase);
+	}
 	height = font->height / buffer_scale + vertical_padding * 2;
 
+	/* The startup font stays referenced, since the prewarm thread uses it */
+	font_cache[0].scale = buffer_scale * 120;
+	font_cache[0].refs = 1;
+	font_cache[0].font = font;
+
+	/* Fonts for other scales are loaded as outputs report them */
+	wl_list_init(&font_loads);
+	if ((font_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		EDIE("eventfd");
+
 	/* Configure tag names */
 	if (!tags) {
 		tags_l = 9;
@@ -1378,26 +4281,107 @@ main(int argc, char **argv)
 				EDIE("strdup");
 		}
 	}
-	
+
+	/* Warm up the glyph cache while the bars are set up and configured */
+	if ((err = start_thread(&prewarm_thread, prewarm, font)))
+		fprintf(stderr, "Could not start prewarm thread: %s\n", strerror(err));
+	else
+		prewarm_started = true;
+
+	/* Start render workers before anything is laid out, so that every
+	 * glyph in a layout has been validated for them */
+	wl_list_init(&render_queue);
+	wl_list_init(&render_done);
+	if (render_threads) {
+		if ((render_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+			EDIE("eventfd");
+		if (!(render_workers = calloc(render_threads, sizeof(pthread_t))))
+			EDIE("calloc");
+		for (; render_workers_l < render_threads; render_workers_l++)
+			if ((err = start_thread(&render_workers[render_workers_l], render_worker, NULL)))
+				DIE("Could not start render thread: %s", strerror(err));
+	}
+
+	/* Keep fills for the theme's text colors around for good */
+	get_fill(&fill_cache, &active_fg_color, true);
+	get_fill(&fill_cache, &inactive_fg_color, true);
+	get_fill(&fill_cache, &urgent_fg_color, true);
+	get_fill(&fill_cache, &title_fg_color, true);
+
 	/* Setup bars and seats */
 	wl_list_for_each(bar, &bar_list, link)
 		setup_bar(bar);
 	wl_list_for_each(seat, &seat_list, link)
 		setup_seat(seat);
+	trace_startup("surfaces created");
 	wl_display_roundtrip(display);
+	trace_startup("surfaces configured");
 
 	/* Configure stdin */
+	struct stat st;
+	stdin_pipe = fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
 	if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1)
 		EDIE("fcntl");
+	line_reader_init(&stdin_reader, max_line_length);
+	stdin_reader.binary = binary_stdin;
+
+	/* Set up event sources */
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		EDIE("epoll_create1");
+	wl_list_init(&source_list);
+	wl_list_init(&removed_sources);
+
+	bool stdin_eof = false;
+	if (!add_source(STDIN_FILENO, EPOLLIN, stdin_handler, NULL)) {
+		/* Regular files cannot be polled; they are always ready, so
+		 * read them to the end like the loop would */
+		if (errno != EPERM)
+			EDIE("epoll_ctl");
+		while (read_stdin() != -1);
+		stdin_eof = true;
+	}
+
+	frame_timer = add_timer(CLOCK_MONOTONIC, frame_timer_handler, NULL);
+	if (render_efd != -1)
+		add_source(render_efd, EPOLLIN, render_done_handler, NULL);
+	if (!add_source(font_efd, EPOLLIN, font_load_handler, NULL))
+		EDIE("epoll_ctl");
+
+	start_modules();
+
+	/* Set up control socket */
+	wl_list_init(&client_list);
+	char *default_socket_path = NULL;
+	if (!no_socket && !socket_path) {
+		const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+		const char *wayland_display = getenv("WAYLAND_DISPLAY");
+		if (runtime_dir && asprintf(&default_socket_path, "%s/" PROGRAM "-%s.sock", runtime_dir,
+					    wayland_display ? wayland_display : "wayland-0") == -1)
+			EDIE("asprintf");
+		socket_path = default_socket_path;
+	}
+	if (!no_socket && socket_path && (socket_fd = setup_socket()) != -1)
+		if (!add_source(socket_fd, EPOLLIN, socket_handler, NULL))
+			EDIE("epoll_ctl");
 
 	/* Set up signals */
-	signal(SIGINT, sig_handler);
-	signal(SIGHUP, sig_handler);
-	signal(SIGTERM, sig_handler);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		EDIE("sigprocmask");
+	int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd == -1)
+		EDIE("signalfd");
+	if (!add_source(sfd, EPOLLIN, signal_handler, NULL))
+		EDIE("epoll_ctl");
 	signal(SIGCHLD, SIG_IGN);
 	
 	/* Run */
-	run_display = true;
+	run_display = !stdin_eof || socket_fd != -1;
 	event_loop();
 
 	/* Clean everything up */
@@ -1411,12 +4395,62 @@ main(int argc, char **argv)
 		teardown_bar(bar);
 	wl_list_for_each_safe(seat, seat2, &seat_list, link)
 		teardown_seat(seat);
+
+	/* Every bar has waited for its frame, so the workers are idle */
+	pthread_mutex_lock(&render_lock);
+	render_quit = true;
+	pthread_cond_broadcast(&render_queued);
+	pthread_mutex_unlock(&render_lock);
+	for (int i = 0; i < render_workers_l; i++)
+		pthread_join(render_workers[i], NULL);
+	free(render_workers);
 	
 	zriver_control_v1_destroy(river_control);
 	zriver_status_manager_v1_destroy(river_status_manager);
 	zwlr_layer_shell_v1_destroy(layer_shell);
+	if (subcompositor)
+		wl_subcompositor_destroy(subcompositor);
+	if (viewporter)
+		wp_viewporter_destroy(viewporter);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
 	
-	fcft_destroy(font);
+	Client *client, *client2;
+	wl_list_for_each_safe(client, client2, &client_list, link)
+		client_destroy(client);
+	Binding *binding, *binding2;
+	wl_list_for_each_safe(binding, binding2, &binding_list, link) {
+		free(binding->name);
+		free(binding);
+	}
+	if (socket_fd != -1) {
+		close(socket_fd);
+		unlink(socket_path);
+	}
+	free(default_socket_path);
+
+	wl_list_for_each_safe(module, module2, &module_list, link) {
+		free(module->status);
+		free(module);
+	}
+
+	EventSource *source, *source2;
+	wl_list_for_each_safe(source, source2, &source_list, link)
+		remove_source(source);
+	free_removed_sources();
+	close(sfd);
+	if (render_efd != -1)
+		close(render_efd);
+	close(epoll_fd);
+	line_reader_finish(&stdin_reader);
+	fill_cache_finish(&fill_cache);
+	atomic_store_explicit(&prewarm_stop, true, memory_order_relaxed);
+	if (prewarm_started)
+		pthread_join(prewarm_thread, NULL);
+	font_loads_finish();
+	close(font_efd);
+	free(prewarm_codepoints);
+	font_cache_finish();
 	fcft_fini();
 	
 	wl_shm_destroy(shm);